@@ -0,0 +1,374 @@
+#include "blending.h"
+#include "compositor.h"
+#include <opencv2/imgproc.hpp>
+#include <omp.h>
+#include <algorithm>
+
+// Fills the pixels of _im_ that _coverage_ marks as uncovered from their covered surroundings
+// (push-pull), so that the edge of an image does not bleed into its Laplacian pyramid.
+static void fillUncovered(cv::Mat &im, const cv::Mat &coverage) {
+	// push: premultiplied color and coverage, down to a single pixel.
+	std::vector<cv::Mat> colors(1), covers(1, coverage);
+	colors[0] = im.clone();
+	for (int r = 0; r < im.rows; ++r) {
+		cv::Vec3f *c = colors[0].ptr<cv::Vec3f>(r);
+		const float *w = coverage.ptr<float>(r);
+		for (int x = 0; x < im.cols; ++x) c[x] *= w[x];
+	}
+	while (colors.back().rows > 1 || colors.back().cols > 1) {
+		cv::Mat color, cover;
+		cv::pyrDown(colors.back(), color);
+		cv::pyrDown(covers.back(), cover);
+		colors.push_back(color);
+		covers.push_back(cover);
+	}
+
+	// pull: composite every level over the upsampled coarser level.
+	cv::Mat filled = colors.back().clone();
+	{
+		float w = covers.back().at<float>(0, 0);
+		filled.at<cv::Vec3f>(0, 0) *= w > 0.0f ? 1.0f / w : 0.0f;
+	}
+	for (int l = int(colors.size()) - 2; l >= 0; --l) {
+		cv::Mat up;
+		cv::pyrUp(filled, up, colors[l].size());
+		for (int r = 0; r < up.rows; ++r) {
+			cv::Vec3f *u = up.ptr<cv::Vec3f>(r);
+			const cv::Vec3f *c = colors[l].ptr<cv::Vec3f>(r);
+			const float *w = covers[l].ptr<float>(r);
+			for (int x = 0; x < up.cols; ++x) {
+				float cover = std::min(w[x], 1.0f);
+				u[x] = c[x] + u[x] * (1.0f - cover);
+			}
+		}
+		filled = up;
+	}
+	im = filled;
+}
+
+void assignMasks(const std::vector<cv::Mat> & weights, std::vector<cv::Mat> & masks) {
+	const int nImages = int(weights.size());
+	masks.assign(nImages, cv::Mat());
+	cv::Size size;
+	for (int i = 0; i < nImages; ++i) if (!weights[i].empty()) {
+		masks[i] = cv::Mat::zeros(weights[i].size(), CV_32FC1);
+		size = weights[i].size();
+	}
+
+#pragma omp parallel for
+	for (int r = 0; r < size.height; ++r) {
+		for (int c = 0; c < size.width; ++c) {
+			int best = -1;
+			float bestWeight = 0.0f;
+			for (int i = 0; i < nImages; ++i) {
+				if (weights[i].empty()) continue;
+				float w = weights[i].ptr<float>(r)[c];
+				if (w > bestWeight) { best = i; bestWeight = w; }
+			}
+			if (best >= 0) masks[best].ptr<float>(r)[c] = 1.0f;
+		}
+	}
+}
+
+// >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> Seam finding >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
+
+// A seam between images _first_ (left of / above the seam) and _second_.
+// position[k] is the column (or row, if !vertical) where the seam crosses the k-th
+// downscaled row (column) of _bounds_.
+struct Seam {
+	int first, second;
+	cv::Rect bounds;
+	bool vertical;
+	std::vector<int> position;
+};
+
+// the part of the canvas where images _i_ and _j_ may both have weight.
+static cv::Rect overlapBox(const std::vector<cv::Mat> &weights, const std::vector<cv::Rect> &bounds, int i, int j) {
+	return bounds[i] & bounds[j] & cv::Rect(cv::Point(0, 0), weights[i].size());
+}
+
+static Seam findSeam(const std::vector<cv::Mat> &warped, const std::vector<cv::Mat> &weights,
+	const std::vector<cv::Rect> &bounds, int i, int j, int downscale)
+{
+	Seam seam;
+	seam.first = i; seam.second = j;
+
+	// the overlap band, searched for inside the intersection of the bounds only.
+	const cv::Rect box = overlapBox(weights, bounds, i, j);
+	int minX = box.x + box.width, minY = box.y + box.height, maxX = -1, maxY = -1;
+	for (int r = box.y; r < box.y + box.height; ++r) {
+		const float *wi = weights[i].ptr<float>(r), *wj = weights[j].ptr<float>(r);
+		for (int c = box.x; c < box.x + box.width; ++c) {
+			if (wi[c] > 0.0f && wj[c] > 0.0f) {
+				minX = std::min(minX, c); maxX = std::max(maxX, c);
+				minY = std::min(minY, r); maxY = std::max(maxY, r);
+			}
+		}
+	}
+	if (maxX < 0) return seam;
+	seam.bounds = cv::Rect(minX, minY, maxX - minX + 1, maxY - minY + 1);
+
+	// a tall overlap band is cut from top to bottom, a wide one from left to right, with
+	// the image whose bounds lie further left (up) on the left (upper) side.
+	seam.vertical = seam.bounds.height >= seam.bounds.width;
+	const cv::Rect &bi = bounds[i], &bj = bounds[j];
+	float centerI = seam.vertical ? bi.x + 0.5f * bi.width : bi.y + 0.5f * bi.height;
+	float centerJ = seam.vertical ? bj.x + 0.5f * bj.width : bj.y + 0.5f * bj.height;
+	if (centerI > centerJ)
+		std::swap(seam.first, seam.second);
+
+	// downscaled cost map, indexed [along the seam][across the seam]:
+	// squared color difference inside the overlap, prohibitive outside of it.
+	const cv::Rect &b = seam.bounds;
+	const int along = ((seam.vertical ? b.height : b.width) + downscale - 1) / downscale;
+	const int across = ((seam.vertical ? b.width : b.height) + downscale - 1) / downscale;
+	const float OUTSIDE = 1e6f;
+	std::vector<float> cost(along * across, 0.0f);
+	std::vector<int> count(along * across, 0);
+	std::vector<bool> anyOverlap(along, false);
+	for (int r = b.y; r < b.y + b.height; ++r) {
+		const float *wi = weights[i].ptr<float>(r), *wj = weights[j].ptr<float>(r);
+		const cv::Vec3f *ci = warped[i].ptr<cv::Vec3f>(r), *cj = warped[j].ptr<cv::Vec3f>(r);
+		for (int c = b.x; c < b.x + b.width; ++c) {
+			int p = (seam.vertical ? r - b.y : c - b.x) / downscale;
+			int q = (seam.vertical ? c - b.x : r - b.y) / downscale;
+			if (wi[c] > 0.0f && wj[c] > 0.0f) {
+				cv::Vec3f d = ci[c] - cj[c];
+				cost[p * across + q] += d.dot(d);
+				count[p * across + q]++;
+				anyOverlap[p] = true;
+			}
+		}
+	}
+	for (int p = 0; p < along; ++p) {
+		for (int q = 0; q < across; ++q) {
+			int k = p * across + q;
+			// a line without any overlap does not constrain the seam.
+			if (!anyOverlap[p]) cost[k] = 0.0f;
+			else cost[k] = count[k] > 0 ? cost[k] / count[k] : OUTSIDE;
+		}
+	}
+
+	// energy[p][q]: cheapest seam from the first line down to cell (p, q), moving at most
+	// one cell across per line.
+	std::vector<float> energy(cost);
+	for (int p = 1; p < along; ++p) {
+		for (int q = 0; q < across; ++q) {
+			float best = energy[(p - 1) * across + q];
+			if (q > 0) best = std::min(best, energy[(p - 1) * across + q - 1]);
+			if (q + 1 < across) best = std::min(best, energy[(p - 1) * across + q + 1]);
+			energy[p * across + q] += best;
+		}
+	}
+	seam.position.resize(along);
+	int q = int(std::min_element(energy.end() - across, energy.end()) - (energy.end() - across));
+	for (int p = along - 1; p >= 0; --p) {
+		seam.position[p] = q;
+		if (p == 0) break;
+		int bestQ = q;
+		for (int dq = -1; dq <= 1; ++dq) {
+			int nq = q + dq;
+			if (nq >= 0 && nq < across && energy[(p - 1) * across + nq] < energy[(p - 1) * across + bestQ])
+				bestQ = nq;
+		}
+		q = bestQ;
+	}
+	return seam;
+}
+
+void findSeams(const std::vector<cv::Mat> & warped, const std::vector<cv::Mat> & weights,
+	const std::vector< std::pair<int, int> > & pairs, const std::vector<cv::Rect> & bounds,
+	std::vector<cv::Mat> & masks, int downscale)
+{
+	const int nPairs = int(pairs.size());
+	std::vector<Seam> seams(nPairs);
+#pragma omp parallel for schedule(dynamic)
+	for (int k = 0; k < nPairs; ++k) {
+		seams[k] = findSeam(warped, weights, bounds, pairs[k].first, pairs[k].second, downscale);
+	}
+
+	// cutting is cheap compared to the search, and pairs sharing an image write the same
+	// mask, so seams are applied one after another.
+	for (const Seam &seam : seams) {
+		if (seam.position.empty()) continue;
+		const cv::Rect &b = seam.bounds;
+		const cv::Mat &wFirst = weights[seam.first], &wSecond = weights[seam.second];
+		cv::Mat &mFirst = masks[seam.first], &mSecond = masks[seam.second];
+#pragma omp parallel for
+		for (int r = b.y; r < b.y + b.height; ++r) {
+			for (int c = b.x; c < b.x + b.width; ++c) {
+				if (wFirst.ptr<float>(r)[c] <= 0.0f || wSecond.ptr<float>(r)[c] <= 0.0f) continue;
+				// leave pixels that belong to a third image alone.
+				if (mFirst.ptr<float>(r)[c] == 0.0f && mSecond.ptr<float>(r)[c] == 0.0f) continue;
+				int p = (seam.vertical ? r - b.y : c - b.x) / downscale;
+				int across = seam.vertical ? c - b.x : r - b.y;
+				int cut = seam.position[p] * downscale + downscale / 2;
+				bool first = across < cut;
+				mFirst.ptr<float>(r)[c] = first ? 1.0f : 0.0f;
+				mSecond.ptr<float>(r)[c] = first ? 0.0f : 1.0f;
+			}
+		}
+	}
+}
+
+void seamBlend(const std::vector<cv::Mat> & warped, const std::vector<cv::Mat> & weights,
+	const std::vector<cv::Mat> & masks, const std::vector< std::pair<int, int> > & pairs,
+	const std::vector<cv::Rect> & bounds, cv::Mat & out, int bandWidth)
+{
+	const int nImages = int(warped.size());
+	cv::Size size;
+	for (int i = 0; i < nImages; ++i) if (!warped[i].empty()) size = warped[i].size();
+
+	// every pixel takes the color of the image its mask assigns it to; outside the overlaps
+	// that is the only image covering it.
+	out.create(size, CV_32FC3);
+#pragma omp parallel for
+	for (int r = 0; r < size.height; ++r) {
+		cv::Vec3f *o = out.ptr<cv::Vec3f>(r);
+		for (int c = 0; c < size.width; ++c) {
+			o[c] = BGCOLOR;
+			for (int i = 0; i < nImages; ++i) {
+				if (warped[i].empty() || masks[i].ptr<float>(r)[c] <= 0.0f) continue;
+				o[c] = warped[i].ptr<cv::Vec3f>(r)[c];
+				break;
+			}
+		}
+	}
+
+	// Feather the masks inside every overlap. A box filter of _bandWidth_ only reads half
+	// of it around a pixel, so the masks are filtered over the overlap grown by that much.
+	// Overlaps of different pairs may intersect; their pixels get the same result from
+	// either pair, but the pairs are processed one after another to not write them concurrently.
+	const int margin = bandWidth / 2 + 1;
+	const cv::Rect canvas(cv::Point(0, 0), size);
+	for (const std::pair<int, int> &pair : pairs) {
+		const cv::Rect box = overlapBox(weights, bounds, pair.first, pair.second);
+		if (box.area() == 0) continue;
+		const cv::Rect grown = cv::Rect(box.x - margin, box.y - margin, box.width + 2 * margin, box.height + 2 * margin) & canvas;
+		const cv::Point offset = box.tl() - grown.tl();
+
+		// the images that may cover part of the box.
+		std::vector<int> layers;
+		for (int i = 0; i < nImages; ++i) {
+			if (!warped[i].empty() && (bounds[i] & box).area() > 0) layers.push_back(i);
+		}
+		const int nLayers = int(layers.size());
+		std::vector<cv::Mat> feathered(nLayers);
+		for (int k = 0; k < nLayers; ++k) {
+			cv::blur(masks[layers[k]](grown), feathered[k], cv::Size(bandWidth, bandWidth));
+		}
+
+#pragma omp parallel for
+		for (int r = box.y; r < box.y + box.height; ++r) {
+			cv::Vec3f *o = out.ptr<cv::Vec3f>(r);
+			for (int c = box.x; c < box.x + box.width; ++c) {
+				cv::Vec3f colorSum(0.0f, 0.0f, 0.0f);
+				float weightSum = 0.0f;
+				int nCovering = 0;
+				for (int k = 0; k < nLayers; ++k) {
+					const int i = layers[k];
+					if (weights[i].ptr<float>(r)[c] <= 0.0f) continue;
+					float w = feathered[k].ptr<float>(r - box.y + offset.y)[c - box.x + offset.x];
+					colorSum += warped[i].ptr<cv::Vec3f>(r)[c] * w;
+					weightSum += w;
+					nCovering++;
+				}
+				if (nCovering > 1 && weightSum > 0.0f)
+					o[c] = colorSum * (1.0f / weightSum);
+			}
+		}
+	}
+}
+
+// <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<< Seam finding <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+
+void multiBandBlend(const std::vector<cv::Mat> & warped, const std::vector<cv::Mat> & weights,
+	const std::vector<cv::Mat> & masks, cv::Mat & out, int nBands)
+{
+	assert(warped.size() == weights.size() && warped.size() == masks.size());
+	std::vector<int> valid;
+	for (size_t i = 0; i < warped.size(); ++i) {
+		if (!warped[i].empty()) valid.push_back(int(i));
+	}
+	if (valid.empty()) return;
+	const int nValid = int(valid.size());
+	const cv::Size size = warped[valid[0]].size();
+
+	// every level halves the size; keep the coarsest level at least a few pixels wide.
+	int maxBands = 0;
+	for (int s = std::min(size.width, size.height); s > 8; s /= 2) maxBands++;
+	nBands = std::max(0, std::min(nBands, maxBands));
+
+	std::vector<cv::Mat> coverages(nValid);
+	for (int k = 0; k < nValid; ++k) {
+		coverages[k].create(size, CV_32FC1);
+		const cv::Mat &weight = weights[valid[k]];
+		for (int r = 0; r < size.height; ++r) {
+			const float *w = weight.ptr<float>(r);
+			float *cover = coverages[k].ptr<float>(r);
+			for (int c = 0; c < size.width; ++c) cover[c] = w[c] > 0.0f ? 1.0f : 0.0f;
+		}
+	}
+
+	// Laplacian pyramid of every image and Gaussian pyramid of its mask, one image per thread.
+	std::vector< std::vector<cv::Mat> > laplacians(nValid), maskPyrs(nValid);
+#pragma omp parallel for schedule(dynamic)
+	for (int k = 0; k < nValid; ++k) {
+		cv::Mat gauss = warped[valid[k]].clone();
+		fillUncovered(gauss, coverages[k]);
+		std::vector<cv::Mat> &lap = laplacians[k];
+		std::vector<cv::Mat> &maskPyr = maskPyrs[k];
+		maskPyr.push_back(masks[valid[k]]);
+		for (int l = 0; l < nBands; ++l) {
+			cv::Mat down, up, mask;
+			cv::pyrDown(gauss, down);
+			cv::pyrUp(down, up, gauss.size());
+			lap.push_back(gauss - up);
+			gauss = down;
+			cv::pyrDown(maskPyr.back(), mask);
+			maskPyr.push_back(mask);
+		}
+		lap.push_back(gauss);
+	}
+
+	// blend every level, then collapse the blended pyramid from the coarsest level up.
+	cv::Mat result;
+	for (int l = nBands; l >= 0; --l) {
+		const cv::Size levelSize = laplacians[0][l].size();
+		cv::Mat blended(levelSize, CV_32FC3);
+#pragma omp parallel for
+		for (int r = 0; r < levelSize.height; ++r) {
+			cv::Vec3f *b = blended.ptr<cv::Vec3f>(r);
+			for (int c = 0; c < levelSize.width; ++c) {
+				cv::Vec3f colorSum(0.0f, 0.0f, 0.0f);
+				float weightSum = 0.0f;
+				for (int k = 0; k < nValid; ++k) {
+					float w = maskPyrs[k][l].ptr<float>(r)[c];
+					colorSum += laplacians[k][l].ptr<cv::Vec3f>(r)[c] * w;
+					weightSum += w;
+				}
+				b[c] = weightSum > 1e-6f ? colorSum * (1.0f / weightSum) : cv::Vec3f(0.0f, 0.0f, 0.0f);
+			}
+		}
+		if (result.empty()) {
+			result = blended;
+		}
+		else {
+			cv::Mat up;
+			cv::pyrUp(result, up, levelSize);
+			result = up + blended;
+		}
+	}
+
+	out.create(size, CV_32FC3);
+#pragma omp parallel for
+	for (int r = 0; r < size.height; ++r) {
+		const cv::Vec3f *res = result.ptr<cv::Vec3f>(r);
+		cv::Vec3f *o = out.ptr<cv::Vec3f>(r);
+		for (int c = 0; c < size.width; ++c) {
+			bool covered = false;
+			for (int k = 0; k < nValid && !covered; ++k) covered = coverages[k].ptr<float>(r)[c] > 0.0f;
+			o[c] = covered ? res[c] : BGCOLOR;
+		}
+	}
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <utility>
+#include <vector>
+// blenders that combine images which have already been warped onto a common canvas.
+
+// Assigns every canvas pixel to the image with the largest weight there: masks[i] is a
+// CV_32FC1 image that is 1 where image _i_ wins and 0 elsewhere. Empty weights are skipped.
+void assignMasks(const std::vector<cv::Mat> & weights, std::vector<cv::Mat> & masks);
+
+// Moves the boundary between every pair of images in _pairs_ onto a minimum-cost seam through
+// their overlap (where both weights are nonzero), found by dynamic programming on a cost map
+// of color differences downscaled by _downscale_. Pairs are searched in parallel.
+// bounds[i] contains the canvas pixels image _i_ covers (e.g. CanvasPlan::bounds); only the
+// intersection of the bounds of a pair is scanned for its overlap.
+void findSeams(const std::vector<cv::Mat> & warped, const std::vector<cv::Mat> & weights,
+	const std::vector< std::pair<int, int> > & pairs, const std::vector<cv::Rect> & bounds,
+	std::vector<cv::Mat> & masks, int downscale = 4);
+
+// Feathers the masks over a band of _bandWidth_ pixels around their boundaries (the seams),
+// and blends the warped images with the result. Pixels only one image covers are copied
+// from it; the masks are only feathered and blended inside the intersections of the _bounds_
+// of the overlapping _pairs_ (as for findSeams), where all pixels covered twice or more lie.
+// Canvas pixels that no image covers are set to BGCOLOR.
+void seamBlend(const std::vector<cv::Mat> & warped, const std::vector<cv::Mat> & weights,
+	const std::vector<cv::Mat> & masks, const std::vector< std::pair<int, int> > & pairs,
+	const std::vector<cv::Rect> & bounds, cv::Mat & out, int bandWidth = 16);
+
+// Multi-band (Laplacian pyramid) blending, after Burt and Adelson.
+// _warped_ are CV_32FC3 images on the canvas and _weights_ their CV_32FC1 blending weights,
+// 0 where an image does not cover the canvas; empty entries are skipped. _masks_ (from
+// assignMasks or findSeams) say which image every pixel belongs to; at every coarser level
+// of the pyramid they are smoothed over a twice as wide band, so low frequencies blend
+// over wide transitions and details over narrow ones.
+// Canvas pixels that no image covers are set to BGCOLOR.
+void multiBandBlend(const std::vector<cv::Mat> & warped, const std::vector<cv::Mat> & weights,
+	const std::vector<cv::Mat> & masks, cv::Mat & out, int nBands = 5);
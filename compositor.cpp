@@ -0,0 +1,711 @@
+#include "compositor.h"
+#include "blending.h"
+#include "tiledcanvas.h"
+#include <omp.h>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+const cv::Vec3f BGCOLOR(0.01f, 0.01f, 0.01f);
+
+std::vector<cv::Rect> canvasTiles(cv::Size size) {
+	std::vector<cv::Rect> tiles;
+	for (int y = 0; y < size.height; y += COMPOSITOR_TILE_SIZE) {
+		for (int x = 0; x < size.width; x += COMPOSITOR_TILE_SIZE) {
+			int w = std::min(COMPOSITOR_TILE_SIZE, size.width - x);
+			int h = std::min(COMPOSITOR_TILE_SIZE, size.height - y);
+			tiles.push_back(cv::Rect(x, y, w, h));
+		}
+	}
+	return tiles;
+}
+
+float featherWeight(float x, float y, int cols, int rows) {
+	// distance to the center, in [0, 1]. 0 means at the center, 1 means at the border.
+	float dx = std::abs(2.0f * x / cols - 1.0f);
+	float dy = std::abs(2.0f * y / rows - 1.0f);
+	// keep a small weight at the border so that pixels only one image covers are not dropped.
+	return std::max((1.0f - dx) * (1.0f - dy), 1e-3f);
+}
+
+// Positions of a run of pixels of one canvas row in a source image, projected in one batch
+// (see Matrix3f::projectRow). Kernels keep one per source and reuse it from row to row.
+struct RowProjection {
+	std::vector<float> x, y;
+	std::vector<std::uint32_t> valid;
+
+	// projects the pixels [u0, u0 + n) of canvas row _v_ through _M_, and then through _lens_ if any.
+	void project(const Matrix3f &M, const UndistortionMap *lens, int u0, int v, int n) {
+		x.resize(n);
+		y.resize(n);
+		valid.resize((n + 31) / 32);
+		M.projectRow(u0 + 0.5f, v + 0.5f, n, x.data(), y.data(), valid.data());
+		if (lens)
+			lens->apply(x.data(), y.data(), valid.data(), n);
+	}
+	// whether the k-th pixel falls inside an image of _size_.
+	bool inside(int k, cv::Size size) const {
+		return batchValid(valid.data(), k) && x[k] >= 0 && x[k] <= size.width - 1 && y[k] >= 0 && y[k] <= size.height - 1;
+	}
+};
+
+cv::Rect projectedBounds(const PPC * viewPPC, cv::Size canvasSize, const PPC * objPPC, cv::Size imSize) {
+	// maps homogeneous image pixel coordinates to homogeneous canvas pixel coordinates.
+	Matrix3f M = viewPPC->GetInverseBasis()*objPPC->GetBasis();
+
+	// the border of the image, through the centers of its outermost pixels.
+	std::vector<Vector3f> polygon = {
+		M * Vector3f{ 0.0f, 0.0f, 1.0f },
+		M * Vector3f{ float(imSize.width - 1), 0.0f, 1.0f },
+		M * Vector3f{ float(imSize.width - 1), float(imSize.height - 1), 1.0f },
+		M * Vector3f{ 0.0f, float(imSize.height - 1), 1.0f }
+	};
+
+	// clip the polygon to the half space in front of the view camera (Sutherland-Hodgman).
+	// Points just in front of the camera project far outside the canvas, which is fine
+	// because the box is clipped to the canvas in the end.
+	float maxZ = 0.0f;
+	for (const Vector3f &p : polygon) maxZ = std::max(maxZ, std::abs(p.z));
+	const float minZ = 1e-4f * maxZ;
+	std::vector<Vector3f> clipped;
+	for (size_t k = 0; k < polygon.size(); ++k) {
+		const Vector3f &p = polygon[k], &q = polygon[(k + 1) % polygon.size()];
+		if (p.z >= minZ)
+			clipped.push_back(p);
+		if ((p.z >= minZ) != (q.z >= minZ))
+			clipped.push_back(p + (q - p) * ((minZ - p.z) / (q.z - p.z)));
+	}
+	if (clipped.empty())
+		return cv::Rect();
+
+	// pixel (u, v) of the canvas samples at (u + 0.5, v + 0.5); one pixel of margin
+	// absorbs rounding in the projection.
+	const float limitX = float(canvasSize.width + 2), limitY = float(canvasSize.height + 2);
+	float minX = limitX, minY = limitY, maxX = -2.0f, maxY = -2.0f;
+	for (const Vector3f &p : clipped) {
+		float x = std::min(std::max(p.x / p.z, -2.0f), limitX);
+		float y = std::min(std::max(p.y / p.z, -2.0f), limitY);
+		minX = std::min(minX, x); maxX = std::max(maxX, x);
+		minY = std::min(minY, y); maxY = std::max(maxY, y);
+	}
+	cv::Rect bounds(cv::Point(int(std::floor(minX)) - 1, int(std::floor(minY)) - 1),
+		cv::Point(int(std::ceil(maxX)) + 1, int(std::ceil(maxY)) + 1));
+	return bounds & cv::Rect(cv::Point(0, 0), canvasSize);
+}
+
+// >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> Gather compositor >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
+
+// Conservatively tests whether any pixel of _tile_ maps inside an image of _imSize_.
+static bool tileMayCover(const Matrix3f &M, const cv::Rect &tile, cv::Size imSize) {
+	const float corners[4][2] = {
+		{ float(tile.x), float(tile.y) },
+		{ float(tile.x + tile.width), float(tile.y) },
+		{ float(tile.x), float(tile.y + tile.height) },
+		{ float(tile.x + tile.width), float(tile.y + tile.height) }
+	};
+	float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX;
+	int nBehind = 0;
+	for (int k = 0; k < 4; ++k) {
+		Vector3f uv = M * Vector3f{ corners[k][0], corners[k][1], 1.0f };
+		if (uv.z <= 0) {
+			nBehind++;
+			continue;
+		}
+		uv /= uv.z;
+		minX = std::min(minX, uv.x); maxX = std::max(maxX, uv.x);
+		minY = std::min(minY, uv.y); maxY = std::max(maxY, uv.y);
+	}
+	if (nBehind == 4) return false;
+	// the tile straddles the plane of the image's camera, so its projection is unbounded.
+	if (nBehind > 0) return true;
+	return maxX >= 0 && minX <= imSize.width - 1 && maxY >= 0 && minY <= imSize.height - 1;
+}
+
+// Whether image _i_ may cover tile _t_ of _plan_. Images whose bounds miss the tile
+// are skipped without projecting its corners.
+static bool mayContribute(const CanvasPlan &plan, int i, int t, cv::Size imSize) {
+	return (plan.bounds[i] & plan.tiles[t]).area() > 0 && tileMayCover(plan.M[i], plan.tiles[t], imSize);
+}
+
+CanvasPlan planCanvas(const PPC * viewPPC, cv::Size size,
+	const std::vector< std::unique_ptr<PPC> > & cameras, const std::vector<cv::Mat> & images)
+{
+	assert(cameras.size() == images.size());
+	CanvasPlan plan;
+	plan.size = size;
+	plan.tiles = canvasTiles(size);
+
+	Matrix3f Mview = viewPPC->GetBasis();
+	for (size_t i = 0; i < cameras.size(); ++i) {
+		plan.M.push_back(cameras[i]->GetInverseBasis()*Mview);
+		plan.lenses.push_back(cameras[i]->GetUndistortionMap());
+		plan.bounds.push_back(projectedBounds(viewPPC, size, cameras[i].get(), images[i].size()));
+	}
+
+	plan.contributors.resize(plan.tiles.size());
+	for (int t = 0; t < int(plan.tiles.size()); ++t) {
+		for (int i = 0; i < int(images.size()); ++i) {
+			if (mayContribute(plan, i, t, images[i].size()))
+				plan.contributors[t].push_back(i);
+		}
+	}
+	return plan;
+}
+
+static void updateWarpLUT(CanvasPlan &plan, const std::vector<cv::Mat> &images, const std::vector<bool> *dirtyTiles);
+
+std::vector<bool> replanImage(CanvasPlan & plan, const PPC * viewPPC, int i, const PPC * objPPC,
+	const std::vector<cv::Mat> & images)
+{
+	plan.M[i] = objPPC->GetInverseBasis()*viewPPC->GetBasis();
+	plan.lenses[i] = objPPC->GetUndistortionMap();
+	plan.bounds[i] = projectedBounds(viewPPC, plan.size, objPPC, images[i].size());
+
+	const int nTiles = int(plan.tiles.size());
+	std::vector<bool> dirty(nTiles, false);
+	for (int t = 0; t < nTiles; ++t) {
+		std::vector<int> &contributors = plan.contributors[t];
+		std::vector<int>::iterator old = std::find(contributors.begin(), contributors.end(), i);
+		bool was = old != contributors.end();
+		bool now = mayContribute(plan, i, t, images[i].size());
+		if (!was && !now)
+			continue;
+		dirty[t] = true;
+		if (was)
+			contributors.erase(old);
+		// contributors stay in drawing order.
+		if (now)
+			contributors.insert(std::lower_bound(contributors.begin(), contributors.end(), i), i);
+	}
+	if (plan.hasLUT())
+		updateWarpLUT(plan, images, &dirty);
+	return dirty;
+}
+
+// Size of the footprint of a canvas pixel in the image that _M_ maps the canvas to, at homogeneous
+// image position _uv_: the length of the longer column of the Jacobian of the homography.
+static float pixelFootprint(const Matrix3f &M, const Vector3f &uv) {
+	const Vector3f &du = M.col(0), &dv = M.col(1);
+	float invZ = 1.0f / uv.z;
+	float x = uv.x * invZ, y = uv.y * invZ;
+	float dxdu = (du.x - x * du.z) * invZ, dydu = (du.y - y * du.z) * invZ;
+	float dxdv = (dv.x - x * dv.z) * invZ, dydv = (dv.y - y * dv.z) * invZ;
+	return std::sqrt(std::max(dxdu * dxdu + dydu * dydu, dxdv * dxdv + dydv * dydv));
+}
+
+float maxFootprint(const CanvasPlan & plan, int i) {
+	const Matrix3f &M = plan.M[i];
+	float result = 0.0f;
+	for (size_t t = 0; t < plan.tiles.size(); ++t) {
+		const std::vector<int> &contributors = plan.contributors[t];
+		if (std::find(contributors.begin(), contributors.end(), i) == contributors.end())
+			continue;
+		const cv::Rect &tile = plan.tiles[t];
+		for (int corner = 0; corner < 4; ++corner) {
+			Vector3f uv = M * Vector3f{ float(tile.x + (corner & 1) * tile.width), float(tile.y + (corner >> 1) * tile.height), 1.0f };
+			if (uv.z > 0)
+				result = std::max(result, pixelFootprint(M, uv));
+		}
+	}
+	return result;
+}
+
+// How the kernels read source images: through a resampling filter and, for images that have
+// mip levels, from the levels matching the footprint of the canvas pixel.
+struct SourceReader {
+	Resampler resampler;
+	const std::vector<MipPyramid> *mips;
+
+	SourceReader(ResampleFilter filter, const std::vector<MipPyramid> *mips) : resampler(filter), mips(mips) {}
+
+	bool hasMips(int i) const { return mips && (*mips)[i].levels.size() > 1; }
+
+	// Color of _image_, the i-th source, at (x, y) = (uv.x / uv.z, uv.y / uv.z).
+	cv::Vec3f read(const cv::Mat &image, int i, const Matrix3f &M, const Vector3f &uv, float x, float y) const {
+		if (hasMips(i))
+			return resampler.sample((*mips)[i], x, y, pixelFootprint(M, uv));
+		return resampler.sample(image, x, y);
+	}
+	// same as above, for a canvas pixel whose footprint in the image is already known.
+	cv::Vec3f read(const cv::Mat &image, int i, float x, float y, float footprint) const {
+		if (hasMips(i))
+			return resampler.sample((*mips)[i], x, y, footprint);
+		return resampler.sample(image, x, y);
+	}
+};
+
+// Footprint of the canvas pixel at (col, row) of a tile in one contributor, estimated from the
+// remap table entries of that contributor (_entries_, one per tile pixel) instead of the
+// homography: the image distances to its right and lower neighbours (left and upper ones at
+// the tile border), like pixelFootprint. Returns a negative value if no neighbour covers the image.
+static float lutFootprint(const cv::Vec2i *entries, int col, int row, cv::Size tile) {
+	const int idx = row * tile.width + col;
+	const float FIXED_TO_FLOAT = 1.0f / 65536.0f;
+	auto distance2 = [&](int n) {
+		const cv::Vec2i &p = entries[idx], &q = entries[n];
+		if (q[0] == WARP_LUT_INVALID) return -1.0f;
+		float dx = (q[0] - p[0]) * FIXED_TO_FLOAT, dy = (q[1] - p[1]) * FIXED_TO_FLOAT;
+		return dx * dx + dy * dy;
+	};
+	float du = -1.0f, dv = -1.0f;
+	if (col + 1 < tile.width) du = distance2(idx + 1);
+	if (du < 0.0f && col > 0) du = distance2(idx - 1);
+	if (row + 1 < tile.height) dv = distance2(idx + tile.width);
+	if (dv < 0.0f && row > 0) dv = distance2(idx - tile.width);
+	float d = std::max(du, dv);
+	return d < 0.0f ? -1.0f : std::sqrt(d);
+}
+
+// Renders tile _t_ of _plan_ into _out_, which holds the pixels of that tile only.
+static void compositeTile(const CanvasPlan &plan, int t, const std::vector<cv::Mat> &images,
+	const std::vector<ExposureModel> &exposures, const SourceReader &reader, cv::Mat out)
+{
+	const cv::Rect &tile = plan.tiles[t];
+	const std::vector<int> &contributors = plan.contributors[t];
+	const int nContributors = int(contributors.size());
+
+	if (nContributors == 0) {
+		out.setTo(cv::Scalar(BGCOLOR[0], BGCOLOR[1], BGCOLOR[2]));
+		return;
+	}
+
+	std::vector<const ExposureModel *> tileExposures(nContributors);
+	for (int k = 0; k < nContributors; ++k) {
+		tileExposures[k] = &imageExposure(exposures, contributors[k]);
+	}
+
+	// rows[k] holds the positions of the current row of the tile in the k-th contributor.
+	std::vector<RowProjection> rows(nContributors);
+	for (int v = tile.y; v < tile.y + tile.height; ++v) {
+		cv::Vec3f *outRow = out.ptr<cv::Vec3f>(v - tile.y) - tile.x;
+		for (int k = 0; k < nContributors; ++k) {
+			rows[k].project(plan.M[contributors[k]], plan.lenses[contributors[k]].get(), tile.x, v, tile.width);
+		}
+
+		for (int u = tile.x; u < tile.x + tile.width; ++u) {
+			cv::Vec3f colorSum(0.0f, 0.0f, 0.0f);
+			float weightSum = 0.0f;
+			for (int k = 0; k < nContributors; ++k) {
+				const int i = contributors[k];
+				const cv::Mat &objImage = images[i];
+				if (!rows[k].inside(u - tile.x, objImage.size()))
+					continue;
+				float x = rows[k].x[u - tile.x], y = rows[k].y[u - tile.x];
+
+				float w = featherWeight(x, y, objImage.cols, objImage.rows);
+				cv::Vec3f objColor;
+				if (reader.hasMips(i))
+					objColor = reader.read(objImage, i, plan.M[i], plan.M[i] * Vector3f{ u + 0.5f, v + 0.5f, 1.0f }, x, y);
+				else
+					objColor = reader.resampler.sample(objImage, x, y);
+				colorSum += tileExposures[k]->correct(objColor, x, y) * w;
+				weightSum += w;
+			}
+			outRow[u] = weightSum > 0.0f ? colorSum * (1.0f / weightSum) : BGCOLOR;
+		}
+	}
+}
+
+// Renders tile _t_ of _plan_ into _out_, reading image positions from the remap table.
+static void compositeTileFromLUT(const CanvasPlan &plan, int t, const std::vector<cv::Mat> &images,
+	const std::vector<ExposureModel> &exposures, const SourceReader &reader, cv::Mat out)
+{
+	const cv::Rect &tile = plan.tiles[t];
+	const std::vector<int> &contributors = plan.contributors[t];
+	const int nContributors = int(contributors.size());
+	const int tileArea = tile.area();
+	const cv::Vec2i *lut = plan.lut.data() + plan.lutOffsets[t];
+	const float FIXED_TO_FLOAT = 1.0f / 65536.0f;
+
+	std::vector<const ExposureModel *> tileExposures(nContributors);
+	for (int k = 0; k < nContributors; ++k) {
+		tileExposures[k] = &imageExposure(exposures, contributors[k]);
+	}
+
+	for (int v = tile.y; v < tile.y + tile.height; ++v) {
+		cv::Vec3f *outRow = out.ptr<cv::Vec3f>(v - tile.y) - tile.x;
+		int idx = (v - tile.y) * tile.width;
+		for (int u = tile.x; u < tile.x + tile.width; ++u, ++idx) {
+			cv::Vec3f colorSum(0.0f, 0.0f, 0.0f);
+			float weightSum = 0.0f;
+			for (int k = 0; k < nContributors; ++k) {
+				const cv::Vec2i &p = lut[k * tileArea + idx];
+				if (p[0] == WARP_LUT_INVALID)
+					continue;
+				const cv::Mat &objImage = images[contributors[k]];
+				const int i = contributors[k];
+				float x = p[0] * FIXED_TO_FLOAT, y = p[1] * FIXED_TO_FLOAT;
+				float w = featherWeight(x, y, objImage.cols, objImage.rows);
+				cv::Vec3f objColor;
+				if (reader.hasMips(i)) {
+					float footprint = lutFootprint(lut + k * tileArea, u - tile.x, v - tile.y, tile.size());
+					objColor = footprint >= 0.0f ? reader.read(objImage, i, x, y, footprint)
+						: reader.read(objImage, i, plan.M[i], plan.M[i] * Vector3f{ u + 0.5f, v + 0.5f, 1.0f }, x, y);
+				}
+				else
+					objColor = reader.resampler.sample(objImage, x, y);
+				colorSum += tileExposures[k]->correct(objColor, x, y) * w;
+				weightSum += w;
+			}
+			outRow[u] = weightSum > 0.0f ? colorSum * (1.0f / weightSum) : BGCOLOR;
+		}
+	}
+}
+
+// Renders tile _t_ of _plan_ into _out_, from the remap table if the plan has one.
+static void compositePlanTile(const CanvasPlan &plan, int t, const std::vector<cv::Mat> &images,
+	const std::vector<ExposureModel> &exposures, const SourceReader &reader, cv::Mat out)
+{
+	if (plan.hasLUT())
+		compositeTileFromLUT(plan, t, images, exposures, reader, out);
+	else
+		compositeTile(plan, t, images, exposures, reader, out);
+}
+
+void compositeCanvas(const CanvasPlan & plan, const std::vector<cv::Mat> & images,
+	const std::vector<ExposureModel> & exposures, cv::Mat & canvas, ResampleFilter filter,
+	const std::vector<MipPyramid> * mips)
+{
+	canvas.create(plan.size, CV_32FC3);
+	const SourceReader reader(filter, mips);
+	int nTiles = int(plan.tiles.size());
+#pragma omp parallel for schedule(dynamic)
+	for (int t = 0; t < nTiles; ++t) {
+		compositePlanTile(plan, t, images, exposures, reader, canvas(plan.tiles[t]));
+	}
+}
+
+void compositeCanvas(const CanvasPlan & plan, const std::vector<cv::Mat> & images,
+	const std::vector<ExposureModel> & exposures, TiledCanvas & canvas, ResampleFilter filter,
+	const std::vector<MipPyramid> * mips)
+{
+	assert(canvas.size() == plan.size);
+	const SourceReader reader(filter, mips);
+	int nTiles = int(plan.tiles.size());
+#pragma omp parallel for schedule(dynamic)
+	for (int t = 0; t < nTiles; ++t) {
+		compositePlanTile(plan, t, images, exposures, reader, canvas.lockTile(t));
+		canvas.unlockTile(t);
+	}
+}
+
+// Writes the colors and weights of every contributor of tile _t_ into its warped image.
+static void warpTile(const CanvasPlan &plan, int t, const std::vector<cv::Mat> &images, const std::vector<ExposureModel> &exposures,
+	const SourceReader &reader, std::vector<cv::Mat> &warped, std::vector<cv::Mat> &weights)
+{
+	const cv::Rect &tile = plan.tiles[t];
+	const std::vector<int> &contributors = plan.contributors[t];
+	const float FIXED_TO_FLOAT = 1.0f / 65536.0f;
+
+	RowProjection row;
+	for (size_t k = 0; k < contributors.size(); ++k) {
+		const int i = contributors[k];
+		const cv::Mat &objImage = images[i];
+		const Matrix3f &M = plan.M[i];
+		const ExposureModel &exposure = imageExposure(exposures, i);
+		const cv::Vec2i *lut = plan.hasLUT() ? plan.lut.data() + plan.lutOffsets[t] + k * tile.area() : nullptr;
+		// the image covers nothing of the tile outside its bounds.
+		const cv::Rect part = tile & plan.bounds[i];
+
+		for (int v = part.y; v < part.y + part.height; ++v) {
+			cv::Vec3f *warpedRow = warped[i].ptr<cv::Vec3f>(v);
+			float *weightRow = weights[i].ptr<float>(v);
+			const cv::Vec2i *lutRow = lut ? lut + (v - tile.y) * tile.width + (part.x - tile.x) : nullptr;
+			if (!lutRow)
+				row.project(M, plan.lenses[i].get(), part.x, v, part.width);
+			for (int u = part.x; u < part.x + part.width; ++u) {
+				float x, y;
+				if (lutRow) {
+					const cv::Vec2i &p = *lutRow++;
+					if (p[0] == WARP_LUT_INVALID)
+						continue;
+					x = p[0] * FIXED_TO_FLOAT; y = p[1] * FIXED_TO_FLOAT;
+				}
+				else {
+					if (!row.inside(u - part.x, objImage.size()))
+						continue;
+					x = row.x[u - part.x]; y = row.y[u - part.x];
+				}
+				cv::Vec3f objColor;
+				float footprint = -1.0f;
+				if (lutRow && reader.hasMips(i))
+					footprint = lutFootprint(lut, u - tile.x, v - tile.y, tile.size());
+				if (footprint >= 0.0f)
+					objColor = reader.read(objImage, i, x, y, footprint);
+				else if (reader.hasMips(i))
+					objColor = reader.read(objImage, i, M, M * Vector3f{ u + 0.5f, v + 0.5f, 1.0f }, x, y);
+				else
+					objColor = reader.resampler.sample(objImage, x, y);
+				warpedRow[u] = exposure.correct(objColor, x, y);
+				weightRow[u] = featherWeight(x, y, objImage.cols, objImage.rows);
+			}
+		}
+	}
+}
+
+void warpImages(const CanvasPlan & plan, const std::vector<cv::Mat> & images, const std::vector<ExposureModel> & exposures,
+	std::vector<cv::Mat> & warped, std::vector<cv::Mat> & weights, ResampleFilter filter,
+	const std::vector<MipPyramid> * mips)
+{
+	const int nImages = int(images.size());
+	std::vector<bool> contributes(nImages, false);
+	for (const std::vector<int> &contributors : plan.contributors) {
+		for (int i : contributors) contributes[i] = true;
+	}
+	warped.assign(nImages, cv::Mat());
+	weights.assign(nImages, cv::Mat());
+	for (int i = 0; i < nImages; ++i) if (contributes[i]) {
+		warped[i] = cv::Mat::zeros(plan.size, CV_32FC3);
+		weights[i] = cv::Mat::zeros(plan.size, CV_32FC1);
+	}
+
+	const SourceReader reader(filter, mips);
+	int nTiles = int(plan.tiles.size());
+#pragma omp parallel for schedule(dynamic)
+	for (int t = 0; t < nTiles; ++t) {
+		warpTile(plan, t, images, exposures, reader, warped, weights);
+	}
+}
+
+// Projects every pixel of tile _t_ into each of its contributors, appending the positions to
+// _tileLUT_, and drops the contributors that do not cover any pixel of the tile.
+static void buildTileLUT(CanvasPlan &plan, int t, const std::vector<cv::Mat> &images, std::vector<cv::Vec2i> &tileLUT) {
+	const cv::Rect &tile = plan.tiles[t];
+	std::vector<int> covering;
+	RowProjection row;
+	for (int i : plan.contributors[t]) {
+		const Matrix3f &M = plan.M[i];
+		const cv::Mat &objImage = images[i];
+		size_t start = tileLUT.size();
+		bool covers = false;
+		for (int v = tile.y; v < tile.y + tile.height; ++v) {
+			row.project(M, plan.lenses[i].get(), tile.x, v, tile.width);
+			for (int k = 0; k < tile.width; ++k) {
+				cv::Vec2i p(WARP_LUT_INVALID, WARP_LUT_INVALID);
+				if (row.inside(k, objImage.size())) {
+					p = cv::Vec2i(int(row.x[k] * 65536.0f), int(row.y[k] * 65536.0f));
+					covers = true;
+				}
+				tileLUT.push_back(p);
+			}
+		}
+		if (covers)
+			covering.push_back(i);
+		else
+			tileLUT.resize(start);
+	}
+	plan.contributors[t] = covering;
+}
+
+// Rebuilds the remap table entries of the tiles in _dirtyTiles_ (all tiles if null),
+// and keeps the entries of the other tiles.
+static void updateWarpLUT(CanvasPlan &plan, const std::vector<cv::Mat> &images, const std::vector<bool> *dirtyTiles) {
+	// positions up to the image size are stored as int(x * 65536).
+	for (const cv::Mat &image : images) {
+		assert(image.cols < WARP_LUT_MAX_IMAGE_SIZE && image.rows < WARP_LUT_MAX_IMAGE_SIZE);
+	}
+	const int nTiles = int(plan.tiles.size());
+	std::vector< std::vector<cv::Vec2i> > tileLUTs(nTiles);
+
+#pragma omp parallel for schedule(dynamic)
+	for (int t = 0; t < nTiles; ++t) {
+		if (!dirtyTiles || (*dirtyTiles)[t]) {
+			buildTileLUT(plan, t, images, tileLUTs[t]);
+		}
+		else {
+			std::vector<cv::Vec2i>::const_iterator begin = plan.lut.begin() + plan.lutOffsets[t];
+			tileLUTs[t].assign(begin, begin + plan.contributors[t].size() * plan.tiles[t].area());
+		}
+	}
+
+	plan.lutOffsets.resize(nTiles);
+	size_t total = 0;
+	for (int t = 0; t < nTiles; ++t) {
+		plan.lutOffsets[t] = total;
+		total += tileLUTs[t].size();
+	}
+	plan.lut.resize(total);
+	for (int t = 0; t < nTiles; ++t) {
+		std::copy(tileLUTs[t].begin(), tileLUTs[t].end(), plan.lut.begin() + plan.lutOffsets[t]);
+	}
+}
+
+void buildWarpLUT(CanvasPlan & plan, const std::vector<cv::Mat> & images) {
+	updateWarpLUT(plan, images, nullptr);
+}
+
+// <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<< Gather compositor <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+
+// >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> Cube map >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
+
+PPC cubeFaceCamera(const PPC & frontPPC, CubeFace face) {
+	// Pan(+) turns the camera right, Tilt(+) turns it down.
+	PPC facePPC = frontPPC;
+	switch (face) {
+	case CUBE_FRONT:                          break;
+	case CUBE_LEFT:   facePPC.Pan(-90.0f);    break;
+	case CUBE_RIGHT:  facePPC.Pan(90.0f);     break;
+	case CUBE_BACK:   facePPC.Pan(180.0f);    break;
+	case CUBE_TOP:    facePPC.Tilt(-90.0f);   break;
+	case CUBE_BOTTOM: facePPC.Tilt(90.0f);    break;
+	default: assert(false);
+	}
+	return facePPC;
+}
+
+// Number of mip levels image _i_ needs for the largest footprint it has on any of _plans_.
+static int mipLevelsNeeded(const std::vector<CanvasPlan> &plans, int i) {
+	float footprint = 0.0f;
+	for (const CanvasPlan &plan : plans) {
+		footprint = std::max(footprint, maxFootprint(plan, i));
+	}
+	return footprint > 1.0f ? 1 + int(std::ceil(std::log2(footprint))) : 1;
+}
+
+CubemapCompositor::CubemapCompositor(const PPC & frontPPC, const std::vector< std::unique_ptr<PPC> > & cameras,
+	const std::vector<cv::Mat> & images, bool cacheWarps)
+	: plans(CUBE_FACES), dirty(CUBE_FACES)
+{
+	for (int f = 0; f < CUBE_FACES; ++f) {
+		faceCameras.push_back(cubeFaceCamera(frontPPC, CubeFace(f)));
+		plans[f] = planCanvas(&faceCameras[f], cv::Size(frontPPC.w, frontPPC.h), cameras, images);
+		if (cacheWarps)
+			buildWarpLUT(plans[f], images);
+		dirty[f].assign(plans[f].tiles.size(), false);
+	}
+
+	// every image gets as many mip levels as the faces minify it by.
+	mips.resize(images.size());
+	for (int i = 0; i < int(images.size()); ++i) {
+		buildMipPyramid(images[i], mipLevelsNeeded(plans, i), mips[i]);
+	}
+}
+
+void CubemapCompositor::updateCamera(int i, const PPC & camera, const std::vector<cv::Mat> & images) {
+	for (int f = 0; f < CUBE_FACES; ++f) {
+		std::vector<bool> changed = replanImage(plans[f], &faceCameras[f], i, &camera, images);
+		for (size_t t = 0; t < changed.size(); ++t) {
+			if (changed[t]) dirty[f][t] = true;
+		}
+	}
+	int nLevels = mipLevelsNeeded(plans, i);
+	if (nLevels > int(mips[i].levels.size()))
+		buildMipPyramid(images[i], nLevels, mips[i]);
+}
+
+// Pairs of images that contribute to a common tile of _plan_, listed from the tiles so that
+// the cost follows the number of overlaps rather than the number of images squared.
+static std::vector< std::pair<int, int> > overlappingPairs(const CanvasPlan &plan) {
+	std::vector< std::pair<int, int> > pairs;
+	for (const std::vector<int> &contributors : plan.contributors) {
+		for (size_t a = 0; a < contributors.size(); ++a)
+			for (size_t b = a + 1; b < contributors.size(); ++b)
+				pairs.push_back(std::minmax(contributors[a], contributors[b]));
+	}
+	std::sort(pairs.begin(), pairs.end());
+	pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+	return pairs;
+}
+
+// Renders face _f_ with a blender that needs all warped images of the face at once.
+void CubemapCompositor::blendFace(int f, const std::vector<cv::Mat> & images, const std::vector<ExposureModel> & exposures,
+	cv::Mat & face, const CompositeOptions & options) const
+{
+	std::vector<cv::Mat> warped, weights, masks;
+	warpImages(plans[f], images, exposures, warped, weights, options.filter, options.mipmaps ? &mips : nullptr);
+	if (std::all_of(warped.begin(), warped.end(), [](const cv::Mat &w) { return w.empty(); })) {
+		// no image reaches this face.
+		face.create(plans[f].size, CV_32FC3);
+		face.setTo(cv::Scalar(BGCOLOR[0], BGCOLOR[1], BGCOLOR[2]));
+		return;
+	}
+	assignMasks(weights, masks);
+	// seams are searched and feathered only where the bounds of both images of a pair meet.
+	const std::vector< std::pair<int, int> > pairs = overlappingPairs(plans[f]);
+	if (options.findSeams)
+		findSeams(warped, weights, pairs, plans[f].bounds, masks);
+	if (options.blend == BLEND_MULTIBAND)
+		multiBandBlend(warped, weights, masks, face);
+	else
+		seamBlend(warped, weights, masks, pairs, plans[f].bounds, face);
+}
+
+void CubemapCompositor::composite(const std::vector<cv::Mat> & images, const std::vector<ExposureModel> & exposures,
+	cv::Mat faces[CUBE_FACES], const CompositeOptions & options) const
+{
+	const bool all[CUBE_FACES] = { true, true, true, true, true, true };
+	compositeFaces(images, exposures, faces, options, all);
+}
+
+void CubemapCompositor::compositeFaces(const std::vector<cv::Mat> & images, const std::vector<ExposureModel> & exposures,
+	cv::Mat faces[CUBE_FACES], const CompositeOptions & options, const bool selected[CUBE_FACES]) const
+{
+	if (options.blend == BLEND_MULTIBAND || options.findSeams) {
+		// these blenders work on whole faces, so faces are processed one after another,
+		// each one in parallel internally.
+		for (int f = 0; f < CUBE_FACES; ++f) {
+			if (selected[f]) blendFace(f, images, exposures, faces[f], options);
+		}
+		return;
+	}
+
+	// one flat list of jobs, so that no face waits for another one to finish.
+	std::vector< std::pair<int, int> > jobs;
+	for (int f = 0; f < CUBE_FACES; ++f) {
+		if (!selected[f]) continue;
+		faces[f].create(plans[f].size, CV_32FC3);
+		for (int t = 0; t < int(plans[f].tiles.size()); ++t) {
+			jobs.push_back(std::make_pair(f, t));
+		}
+	}
+
+	const SourceReader reader(options.filter, options.mipmaps ? &mips : nullptr);
+	const int nJobs = int(jobs.size());
+#pragma omp parallel for schedule(dynamic)
+	for (int job = 0; job < nJobs; ++job) {
+		int f = jobs[job].first, t = jobs[job].second;
+		compositePlanTile(plans[f], t, images, exposures, reader, faces[f](plans[f].tiles[t]));
+	}
+}
+
+void CubemapCompositor::recomposite(const std::vector<cv::Mat> & images, const std::vector<ExposureModel> & exposures,
+	cv::Mat faces[CUBE_FACES], const CompositeOptions & options, bool changedFaces[CUBE_FACES])
+{
+	std::vector< std::pair<int, int> > jobs;
+	for (int f = 0; f < CUBE_FACES; ++f) {
+		for (int t = 0; t < int(dirty[f].size()); ++t) {
+			if (dirty[f][t]) jobs.push_back(std::make_pair(f, t));
+		}
+		changedFaces[f] = std::find(dirty[f].begin(), dirty[f].end(), true) != dirty[f].end();
+		dirty[f].assign(dirty[f].size(), false);
+	}
+
+	if (options.blend == BLEND_MULTIBAND || options.findSeams) {
+		// seams and pyramids reach across the face, so changed faces are blended again as a whole.
+		for (int f = 0; f < CUBE_FACES; ++f) {
+			if (changedFaces[f]) blendFace(f, images, exposures, faces[f], options);
+		}
+		return;
+	}
+
+	const SourceReader reader(options.filter, options.mipmaps ? &mips : nullptr);
+	const int nJobs = int(jobs.size());
+#pragma omp parallel for schedule(dynamic)
+	for (int job = 0; job < nJobs; ++job) {
+		int f = jobs[job].first, t = jobs[job].second;
+		compositePlanTile(plans[f], t, images, exposures, reader, faces[f](plans[f].tiles[t]));
+	}
+}
+
+void CubemapCompositor::composite(const std::vector<cv::Mat> & images, const std::vector<ExposureModel> & exposures,
+	TiledCanvas * const faces[CUBE_FACES], const CompositeOptions & options) const
+{
+	assert(options.blend == BLEND_FEATHER && !options.findSeams);
+	for (int f = 0; f < CUBE_FACES; ++f) {
+		compositeCanvas(plans[f], images, exposures, *faces[f], options.filter, options.mipmaps ? &mips : nullptr);
+	}
+}
+
+// <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<< Cube map <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
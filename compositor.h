@@ -0,0 +1,187 @@
+#pragma once
+#include "geometry.h"
+#include "ppc.h"
+#include "exposure.h"
+#include "resampling.h"
+#include <opencv2/core.hpp>
+#include <climits>
+#include <memory>
+#include <vector>
+// compositor functions: render source images onto the canvas of a view camera.
+
+class TiledCanvas;
+
+// canvas pixels that no image has been drawn onto have this color.
+extern const cv::Vec3f BGCOLOR;
+
+// the canvas is processed in square tiles, each tile is handled by a single thread
+// and walked row by row so that both canvas writes and source reads stay in cache.
+constexpr int COMPOSITOR_TILE_SIZE = 64;
+
+// Splits a canvas of _size_ into tiles of COMPOSITOR_TILE_SIZE (smaller at the right and bottom borders).
+std::vector<cv::Rect> canvasTiles(cv::Size size);
+
+// Feathering weight of pixel (x, y) in an image of _cols_ by _rows_:
+// 1 at the center, falling off linearly to nearly 0 at the borders.
+float featherWeight(float x, float y, int cols, int rows);
+
+// Exposure model of image _i_: exposures[i], or gain 1 without vignetting if _exposures_ is empty.
+// Exposures are corrected while sampling, the source images are never modified.
+inline const ExposureModel & imageExposure(const std::vector<ExposureModel> & exposures, int i) {
+	static const ExposureModel identity;
+	return exposures.empty() ? identity : exposures[i];
+}
+
+// Bounding box of the pixels of a canvas of _canvasSize_, seen by _viewPPC_, that an image of
+// _imSize_ taken by _objPPC_ may cover. The image border is clipped against the plane of
+// _viewPPC_ before it is projected, so images partly behind the view camera are handled too.
+// The box is conservative and clipped to the canvas; it is empty if the image misses the canvas.
+cv::Rect projectedBounds(const PPC * viewPPC, cv::Size canvasSize, const PPC * objPPC, cv::Size imSize);
+
+// >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> Gather compositor >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
+
+// Everything needed to render a canvas in a single pass: the mapping from canvas pixels
+// into every source image, and for every tile the images that may contribute to it.
+struct CanvasPlan {
+	cv::Size size;
+	std::vector<cv::Rect> tiles;
+	// M[i] maps homogeneous canvas pixel coordinates to pixels of image _i_, and lenses[i]
+	// (null for an ideal pinhole) those to pixels of the captured image.
+	std::vector<Matrix3f> M;
+	std::vector< std::shared_ptr<const UndistortionMap> > lenses;
+	// bounds[i] is the projectedBounds of image _i_; images with empty bounds contribute nowhere.
+	std::vector<cv::Rect> bounds;
+	// contributors[t] lists the images that may cover tiles[t], in drawing order.
+	std::vector< std::vector<int> > contributors;
+
+	// Optional remap table (see buildWarpLUT). The k-th contributor of tile _t_ owns
+	// tiles[t].area() entries starting at lutOffsets[t] + k*tiles[t].area(), one per tile
+	// pixel in row-major order, holding its position in that image in 16.16 fixed point.
+	std::vector<size_t> lutOffsets;
+	std::vector<cv::Vec2i> lut;
+	bool hasLUT() const { return !lutOffsets.empty(); }
+};
+
+// marks LUT entries whose canvas pixel falls outside the contributing image.
+constexpr int WARP_LUT_INVALID = INT_MIN;
+// images read through a remap table must be smaller than this along both axes, so that
+// their positions fit in 16.16 fixed point.
+constexpr int WARP_LUT_MAX_IMAGE_SIZE = 32768;
+
+CanvasPlan planCanvas(const PPC * viewPPC, cv::Size size,
+	const std::vector< std::unique_ptr<PPC> > & cameras, const std::vector<cv::Mat> & images);
+
+// Renders all images, corrected by their _exposures_ (see imageExposure) and read with _filter_, onto _canvas_.
+// If _mips_ holds a pyramid for every image, minified images are read from their mip levels.
+// Every canvas pixel is visited once and blended in registers from the contributors of its
+// tile, so no accumulation buffer is needed.
+void compositeCanvas(const CanvasPlan & plan, const std::vector<cv::Mat> & images,
+	const std::vector<ExposureModel> & exposures, cv::Mat & canvas, ResampleFilter filter = RESAMPLE_NEAREST,
+	const std::vector<MipPyramid> * mips = nullptr);
+// Same as above, but renders into an out-of-core canvas (see tiledcanvas.h) one tile at a
+// time, so only the tiles being worked on have to be in memory.
+void compositeCanvas(const CanvasPlan & plan, const std::vector<cv::Mat> & images,
+	const std::vector<ExposureModel> & exposures, TiledCanvas & canvas, ResampleFilter filter = RESAMPLE_NEAREST,
+	const std::vector<MipPyramid> * mips = nullptr);
+
+// Warps every image onto the canvas of _plan_ separately, for blenders that need all layers
+// at once. warped[i] receives the colors of image _i_, corrected by its exposure, and weights[i] its feathering weight,
+// both 0 where the image does not cover the canvas. Images that do not contribute to
+// any tile are left empty.
+void warpImages(const CanvasPlan & plan, const std::vector<cv::Mat> & images, const std::vector<ExposureModel> & exposures,
+	std::vector<cv::Mat> & warped, std::vector<cv::Mat> & weights, ResampleFilter filter = RESAMPLE_NEAREST,
+	const std::vector<MipPyramid> * mips = nullptr);
+
+// Moves image _i_ of _plan_, made for _viewPPC_, to the camera _objPPC_ and updates the tiles
+// it contributes to. Returns for every tile whether the image contributed to it before or does
+// now, i.e. the union of its old and new footprints: the tiles whose pixels may change.
+// If the plan has a remap table, only the entries of those tiles are rebuilt.
+std::vector<bool> replanImage(CanvasPlan & plan, const PPC * viewPPC, int i, const PPC * objPPC,
+	const std::vector<cv::Mat> & images);
+
+// Largest footprint, in pixels of image _i_, of a canvas pixel of _plan_, estimated at the corners
+// of the tiles the image contributes to. Above 1 the canvas minifies the image.
+float maxFootprint(const CanvasPlan & plan, int i);
+
+// Projects every canvas pixel into each contributing image once and stores the result in
+// the remap table of _plan_, dropping contributors that do not cover any pixel of a tile.
+// Later calls to compositeCanvas with this plan only gather and blend.
+// Every image must be smaller than WARP_LUT_MAX_IMAGE_SIZE along both axes.
+void buildWarpLUT(CanvasPlan & plan, const std::vector<cv::Mat> & images);
+
+// <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<< Gather compositor <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+
+enum BlendMode {
+	BLEND_FEATHER,		// weighted average of all contributors
+	BLEND_MULTIBAND		// Laplacian pyramid blending of the warped images, see blending.h
+};
+
+struct CompositeOptions {
+	BlendMode blend = BLEND_FEATHER;
+	// cut the overlap of every pair of images along a minimum-cost seam before blending;
+	// feather blending then only mixes images in a narrow band around the seams.
+	bool findSeams = false;
+	// how source images are read at the non-integer positions canvas pixels map to.
+	ResampleFilter filter = RESAMPLE_NEAREST;
+	// read images that a face minifies from mip levels picked by the footprint of every
+	// canvas pixel, instead of aliasing on single source pixels.
+	bool mipmaps = false;
+};
+
+// >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> Cube map >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
+
+enum CubeFace {
+	CUBE_FRONT, CUBE_LEFT, CUBE_RIGHT, CUBE_BACK, CUBE_TOP, CUBE_BOTTOM,
+	CUBE_FACES	// number of faces
+};
+
+// Returns the camera looking through _face_ of the cube around _frontPPC_,
+// which itself looks through the front face. Every face camera is derived from
+// _frontPPC_ directly, so faces can be built and rendered independently.
+PPC cubeFaceCamera(const PPC & frontPPC, CubeFace face);
+
+// Keeps the plans of all cube faces around, so that the cube map can be re-composited
+// without re-planning. With _cacheWarps_, the remap tables of every face are built once
+// and re-composites skip the projection entirely. Images the faces minify also get mip
+// pyramids, as deep as the largest footprint needs, for CompositeOptions::mipmaps.
+// composite() must be given the same images the compositor was built with.
+class CubemapCompositor {
+public:
+	CubemapCompositor(const PPC & frontPPC, const std::vector< std::unique_ptr<PPC> > & cameras,
+		const std::vector<cv::Mat> & images, bool cacheWarps);
+
+	// Renders all _images_, corrected by _exposures_, onto every face; _faces_ are (re)allocated
+	// to the size of the cube map. Feather blending renders all (face, tile) pairs concurrently.
+	void composite(const std::vector<cv::Mat> & images, const std::vector<ExposureModel> & exposures,
+		cv::Mat faces[CUBE_FACES], const CompositeOptions & options = CompositeOptions()) const;
+	// Same as above, but only renders the faces _f_ for which selected[f] is set; the others are left as they are.
+	void compositeFaces(const std::vector<cv::Mat> & images, const std::vector<ExposureModel> & exposures,
+		cv::Mat faces[CUBE_FACES], const CompositeOptions & options, const bool selected[CUBE_FACES]) const;
+	// Moves image _i_ to _camera_. The tiles it covered before or covers now are marked as dirty.
+	void updateCamera(int i, const PPC & camera, const std::vector<cv::Mat> & images);
+	// Renders only the tiles marked dirty since the last recomposite into _faces_, which must
+	// hold the previous result, and sets changedFaces[f] for every face that was touched.
+	// Multi-band and seam blending re-render every changed face as a whole, so interactive
+	// edits should recomposite with feather blending and pass the changed faces to
+	// compositeFaces with the full blender once the edit is done.
+	void recomposite(const std::vector<cv::Mat> & images, const std::vector<ExposureModel> & exposures,
+		cv::Mat faces[CUBE_FACES], const CompositeOptions & options, bool changedFaces[CUBE_FACES]);
+
+	// Renders into out-of-core faces of the cube map's size with the gather compositor.
+	// _options_ must ask for feather blending without seams, since the other blenders
+	// need whole faces in memory.
+	void composite(const std::vector<cv::Mat> & images, const std::vector<ExposureModel> & exposures,
+		TiledCanvas * const faces[CUBE_FACES], const CompositeOptions & options = CompositeOptions()) const;
+
+private:
+	void blendFace(int f, const std::vector<cv::Mat> & images, const std::vector<ExposureModel> & exposures,
+		cv::Mat & face, const CompositeOptions & options) const;
+
+	std::vector<PPC> faceCameras;
+	std::vector<CanvasPlan> plans;
+	std::vector<MipPyramid> mips;
+	// dirty[f][t]: tile _t_ of face _f_ has to be rendered again.
+	std::vector< std::vector<bool> > dirty;
+};
+
+// <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<< Cube map <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
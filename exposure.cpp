@@ -0,0 +1,326 @@
+#include "exposure.h"
+#include "resampling.h"
+#include <omp.h>
+#include <cmath>
+#include <cstdint>
+
+// >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> Sparse solver >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
+
+// Solves A x = b for a symmetric positive definite A made of B x B blocks, with one block per
+// image on the diagonal (diag) and one per edge at (edges[e].i, edges[e].j) (off, mirrored at
+// (j, i)), all row-major. Conjugate gradients with a block Jacobi preconditioner; _x_ holds the
+// starting point on entry.
+template <int B>
+static void solveBlockSparse(const std::vector<double> & diag, const std::vector<OverlapEdge> & edges,
+	const std::vector<double> & off, const std::vector<double> & b, std::vector<double> & x)
+{
+	const int nBlocks = int(diag.size()) / (B * B), n = nBlocks * B;
+	auto multiply = [&](const std::vector<double> &v, std::vector<double> &out) {
+		for (int i = 0; i < nBlocks; ++i) {
+			const double *D = &diag[i * B * B];
+			for (int r = 0; r < B; ++r) {
+				double sum = 0.0;
+				for (int c = 0; c < B; ++c) sum += D[r * B + c] * v[i * B + c];
+				out[i * B + r] = sum;
+			}
+		}
+		for (size_t e = 0; e < edges.size(); ++e) {
+			const double *O = &off[e * B * B];
+			const int i = edges[e].i, j = edges[e].j;
+			for (int r = 0; r < B; ++r) {
+				for (int c = 0; c < B; ++c) {
+					out[i * B + r] += O[r * B + c] * v[j * B + c];
+					out[j * B + c] += O[r * B + c] * v[i * B + r];
+				}
+			}
+		}
+	};
+	auto dot = [&](const std::vector<double> &u, const std::vector<double> &v) {
+		double sum = 0.0;
+		for (int k = 0; k < n; ++k) sum += u[k] * v[k];
+		return sum;
+	};
+
+	// Cholesky factors of the diagonal blocks, for the preconditioner.
+	std::vector<double> L(diag.size(), 0.0);
+	for (int i = 0; i < nBlocks; ++i) {
+		const double *D = &diag[i * B * B];
+		double *F = &L[i * B * B];
+		for (int r = 0; r < B; ++r) {
+			for (int c = 0; c <= r; ++c) {
+				double sum = D[r * B + c];
+				for (int k = 0; k < c; ++k) sum -= F[r * B + k] * F[c * B + k];
+				F[r * B + c] = r == c ? std::sqrt(std::max(sum, 1e-300)) : sum / F[c * B + c];
+			}
+		}
+	}
+	auto precondition = [&](const std::vector<double> &r, std::vector<double> &z) {
+		for (int i = 0; i < nBlocks; ++i) {
+			const double *F = &L[i * B * B];
+			double *zi = &z[i * B];
+			for (int k = 0; k < B; ++k) {
+				double sum = r[i * B + k];
+				for (int m = 0; m < k; ++m) sum -= F[k * B + m] * zi[m];
+				zi[k] = sum / F[k * B + k];
+			}
+			for (int k = B - 1; k >= 0; --k) {
+				double sum = zi[k];
+				for (int m = k + 1; m < B; ++m) sum -= F[m * B + k] * zi[m];
+				zi[k] = sum / F[k * B + k];
+			}
+		}
+	};
+
+	std::vector<double> r(n), z(n), p(n), Ap(n);
+	multiply(x, Ap);
+	for (int k = 0; k < n; ++k) r[k] = b[k] - Ap[k];
+	precondition(r, z);
+	p = z;
+	double rz = dot(r, z);
+	const double tolerance = 1e-24 * std::max(dot(b, b), 1e-300);
+	// exact arithmetic would converge in _n_ iterations; the margin absorbs rounding.
+	for (int iteration = 0; iteration < 2 * n + 10 && dot(r, r) > tolerance; ++iteration) {
+		multiply(p, Ap);
+		double alpha = rz / dot(p, Ap);
+		for (int k = 0; k < n; ++k) {
+			x[k] += alpha * p[k];
+			r[k] -= alpha * Ap[k];
+		}
+		precondition(r, z);
+		double rzNext = dot(r, z);
+		for (int k = 0; k < n; ++k) p[k] = z[k] + (rzNext / rz) * p[k];
+		rz = rzNext;
+	}
+}
+
+// <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<< Sparse solver <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+
+std::vector<cv::Vec3f> solveGains(int nImages, const OverlapGraph & graph, float sigmaN, float sigmaG)
+{
+	const double wN = 1.0 / (double(sigmaN) * sigmaN), wG = 1.0 / (double(sigmaG) * sigmaG);
+	const std::vector<OverlapEdge> &edges = graph.edges;
+	const int nEdges = int(edges.size());
+	std::vector<cv::Vec3f> gains(nImages, cv::Vec3f(1.0f, 1.0f, 1.0f));
+
+	// total overlap of every image, the weight of its prior.
+	std::vector<double> overlap(nImages, 0.0);
+	for (const OverlapEdge &edge : edges) {
+		double n = 0.5 * (edge.nIJ + edge.nJI);
+		overlap[edge.i] += n;
+		overlap[edge.j] += n;
+	}
+
+	std::vector<double> diag(nImages), off(nEdges), b(nImages), g(nImages);
+	for (int ch = 0; ch < 3; ++ch) {
+		// normal equations of _e_ for this channel.
+		for (int i = 0; i < nImages; ++i) {
+			diag[i] = overlap[i] * wG;
+			b[i] = overlap[i] * wG;
+			g[i] = 1.0;
+		}
+		for (int e = 0; e < nEdges; ++e) {
+			const OverlapEdge &edge = edges[e];
+			double n = 0.5 * (edge.nIJ + edge.nJI) * wN;
+			double Iij = edge.averageIJ[ch], Iji = edge.averageJI[ch];
+			diag[edge.i] += n * Iij * Iij;
+			diag[edge.j] += n * Iji * Iji;
+			off[e] = -n * Iij * Iji;
+		}
+		// images without any overlap only have the prior, and keep a gain of 1.
+		for (int i = 0; i < nImages; ++i) {
+			if (diag[i] == 0.0) {
+				diag[i] = 1.0;
+				b[i] = 1.0;
+			}
+		}
+
+		solveBlockSparse<1>(diag, edges, off, b, g);
+		for (int i = 0; i < nImages; ++i) {
+			gains[i][ch] = float(g[i]);
+		}
+	}
+	return gains;
+}
+
+// >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> Vignetting >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
+
+ExposureModel::ExposureModel() : ExposureModel(cv::Vec3f(1.0f, 1.0f, 1.0f)) {}
+
+ExposureModel::ExposureModel(const cv::Vec3f & gain) : gain(gain), cx(0.0f), cy(0.0f), invRadius2(0.0f) {
+	vignetting[0] = vignetting[1] = vignetting[2] = 0.0f;
+	std::fill(falloff, falloff + FALLOFF_TABLE_SIZE, 1.0f);
+}
+
+ExposureModel::ExposureModel(const cv::Vec3f & gain, const float k[3], cv::Size imSize)
+	: gain(gain), cx(0.5f * imSize.width), cy(0.5f * imSize.height),
+	invRadius2(4.0f / (float(imSize.width) * imSize.width + float(imSize.height) * imSize.height))
+{
+	for (int m = 0; m < 3; ++m) vignetting[m] = k[m];
+	for (int s = 0; s < FALLOFF_TABLE_SIZE; ++s) {
+		float r2 = float(s) / (FALLOFF_TABLE_SIZE - 1);
+		falloff[s] = std::exp(-r2 * (k[0] + r2 * (k[1] + r2 * k[2])));
+	}
+}
+
+// unknowns of every camera: log gains of the three channels, then k1, k2, k3.
+static const int EXPOSURE_UNKNOWNS = 6;
+typedef double ExposureBlock[EXPOSURE_UNKNOWNS * EXPOSURE_UNKNOWNS];
+
+// Normal equations contributed by the samples of one edge.
+struct EdgeNormals {
+	ExposureBlock Hii, Hjj, Hij;
+	double bi[EXPOSURE_UNKNOWNS], bj[EXPOSURE_UNKNOWNS];
+	int nSamples;
+};
+
+// r^2 of (x, y) relative to half the diagonal of an image of _size_, as in ExposureModel.
+static float radius2(float x, float y, cv::Size size) {
+	float dx = x - 0.5f * size.width, dy = y - 0.5f * size.height;
+	return 4.0f * (dx * dx + dy * dy) / (float(size.width) * size.width + float(size.height) * size.height);
+}
+
+// Samples the overlap of _edge_ every _stride_ pixels of image _i_ and accumulates the
+// log-space residuals of the matching colors into _normals_.
+static void sampleEdge(const OverlapEdge &edge, const std::vector< std::unique_ptr<PPC> > &cameras,
+	const std::vector<cv::Mat> &images, int stride, const Resampler &resampler, EdgeNormals &normals)
+{
+	const int i = edge.i, j = edge.j;
+	const cv::Mat &imI = images[i], &imJ = images[j];
+	std::fill(normals.Hii, normals.Hii + EXPOSURE_UNKNOWNS * EXPOSURE_UNKNOWNS, 0.0);
+	std::fill(normals.Hjj, normals.Hjj + EXPOSURE_UNKNOWNS * EXPOSURE_UNKNOWNS, 0.0);
+	std::fill(normals.Hij, normals.Hij + EXPOSURE_UNKNOWNS * EXPOSURE_UNKNOWNS, 0.0);
+	std::fill(normals.bi, normals.bi + EXPOSURE_UNKNOWNS, 0.0);
+	std::fill(normals.bj, normals.bj + EXPOSURE_UNKNOWNS, 0.0);
+	normals.nSamples = 0;
+
+	// only the bounding box of the overlap is walked.
+	std::vector<cv::Point2d> polygon;
+	if (overlapPolygon(cameras[i].get(), imI.size(), cameras[j].get(), imJ.size(), polygon) <= 0.0)
+		return;
+	double minX = imI.cols, minY = imI.rows, maxX = 0.0, maxY = 0.0;
+	for (const cv::Point2d &p : polygon) {
+		minX = std::min(minX, p.x); maxX = std::max(maxX, p.x);
+		minY = std::min(minY, p.y); maxY = std::max(maxY, p.y);
+	}
+
+	// maps homogeneous pixel coordinates of image _i_ to image _j_.
+	Matrix3f M = cameras[j]->GetInverseBasis()*cameras[i]->GetBasis();
+	// the samples are placed on the ideal images, and read from the captured ones through the lens maps.
+	const UndistortionMap *lensI = cameras[i]->GetUndistortionMap().get(), *lensJ = cameras[j]->GetUndistortionMap().get();
+
+	// the samples of a row, and their positions in image _j_.
+	std::vector<float> sampleX, sampleY, sampleZ, rowX, rowY;
+	std::vector<std::uint32_t> rowValid;
+	for (int c = int(minX) + stride / 2; c < int(std::ceil(maxX)) && c + 0.5f <= imI.cols - 1; c += stride) {
+		sampleX.push_back(c + 0.5f);
+	}
+	const int nSamples = int(sampleX.size());
+	sampleY.resize(nSamples);
+	sampleZ.assign(nSamples, 1.0f);
+	rowX.resize(nSamples);
+	rowY.resize(nSamples);
+	rowValid.resize((nSamples + 31) / 32);
+
+	const float DARK = 0.02f, SATURATED = 0.98f;
+	for (int r = int(minY) + stride / 2; r < int(std::ceil(maxY)) && r + 0.5f <= imI.rows - 1; r += stride) {
+		const float yRow = r + 0.5f;
+		std::fill(sampleY.begin(), sampleY.end(), yRow);
+		M.projectBatch(sampleX.data(), sampleY.data(), sampleZ.data(), nSamples, rowX.data(), rowY.data(), rowValid.data());
+		if (lensJ)
+			lensJ->apply(rowX.data(), rowY.data(), rowValid.data(), nSamples);
+		for (int k = 0; k < nSamples; ++k) {
+			const float xj = rowX[k], yj = rowY[k];
+			if (!batchValid(rowValid.data(), k) || xj < 0 || xj > imJ.cols - 1 || yj < 0 || yj > imJ.rows - 1)
+				continue;
+			float xi = sampleX[k], yi = yRow;
+			if (lensI) {
+				cv::Point2f p = (*lensI)(xi, yi);
+				xi = p.x; yi = p.y;
+				if (xi < 0 || xi > imI.cols - 1 || yi < 0 || yi > imI.rows - 1)
+					continue;
+			}
+
+			cv::Vec3f Ii = resampler.sample(imI, xi, yi), Ij = resampler.sample(imJ, xj, yj);
+			bool usable = true;
+			for (int ch = 0; ch < 3; ++ch) {
+				usable = usable && Ii[ch] > DARK && Ii[ch] < SATURATED && Ij[ch] > DARK && Ij[ch] < SATURATED;
+			}
+			if (!usable)
+				continue;
+
+			// residual of channel _ch_: ai . x_i + aj . x_j - d.
+			double ri = radius2(xi, yi, imI.size()), rj = radius2(xj, yj, imJ.size());
+			for (int ch = 0; ch < 3; ++ch) {
+				double ai[EXPOSURE_UNKNOWNS] = { 0.0, 0.0, 0.0, -ri, -ri * ri, -ri * ri * ri };
+				double aj[EXPOSURE_UNKNOWNS] = { 0.0, 0.0, 0.0, rj, rj * rj, rj * rj * rj };
+				ai[ch] = 1.0;
+				aj[ch] = -1.0;
+				double d = std::log(double(Ij[ch])) - std::log(double(Ii[ch]));
+				for (int p = 0; p < EXPOSURE_UNKNOWNS; ++p) {
+					for (int q = 0; q < EXPOSURE_UNKNOWNS; ++q) {
+						normals.Hii[p * EXPOSURE_UNKNOWNS + q] += ai[p] * ai[q];
+						normals.Hjj[p * EXPOSURE_UNKNOWNS + q] += aj[p] * aj[q];
+						normals.Hij[p * EXPOSURE_UNKNOWNS + q] += ai[p] * aj[q];
+					}
+					normals.bi[p] += ai[p] * d;
+					normals.bj[p] += aj[p] * d;
+				}
+			}
+			normals.nSamples++;
+		}
+	}
+}
+
+std::vector<ExposureModel> fitExposure(const std::vector< std::unique_ptr<PPC> > & cameras,
+	const std::vector<cv::Mat> & images, const OverlapGraph & graph, int stride,
+	float sigmaN, float sigmaG, float sigmaV)
+{
+	const int B = EXPOSURE_UNKNOWNS;
+	const int nImages = int(cameras.size());
+	const int nEdges = int(graph.edges.size());
+	const double wN = 1.0 / (double(sigmaN) * sigmaN), wG = 1.0 / (double(sigmaG) * sigmaG), wV = 1.0 / (double(sigmaV) * sigmaV);
+
+	std::vector<EdgeNormals> normals(nEdges);
+	const Resampler resampler(RESAMPLE_BILINEAR);
+#pragma omp parallel for schedule(dynamic)
+	for (int e = 0; e < nEdges; ++e) {
+		sampleEdge(graph.edges[e], cameras, images, stride, resampler, normals[e]);
+	}
+
+	std::vector<double> diag(nImages * B * B, 0.0), off(nEdges * B * B), b(nImages * B, 0.0), x(nImages * B, 0.0);
+	std::vector<int> nSamples(nImages, 0);
+	for (int e = 0; e < nEdges; ++e) {
+		const int i = graph.edges[e].i, j = graph.edges[e].j;
+		for (int k = 0; k < B * B; ++k) {
+			diag[i * B * B + k] += wN * normals[e].Hii[k];
+			diag[j * B * B + k] += wN * normals[e].Hjj[k];
+			off[e * B * B + k] = wN * normals[e].Hij[k];
+		}
+		for (int k = 0; k < B; ++k) {
+			b[i * B + k] += wN * normals[e].bi[k];
+			b[j * B + k] += wN * normals[e].bj[k];
+		}
+		nSamples[i] += normals[e].nSamples;
+		nSamples[j] += normals[e].nSamples;
+	}
+	// the priors pull towards gain 1 and no vignetting, as strongly as the data of the camera.
+	for (int i = 0; i < nImages; ++i) {
+		double n = std::max(nSamples[i], 1);
+		for (int k = 0; k < B; ++k) {
+			diag[i * B * B + k * B + k] += n * (k < 3 ? wG : wV);
+		}
+	}
+
+	solveBlockSparse<EXPOSURE_UNKNOWNS>(diag, graph.edges, off, b, x);
+
+	std::vector<ExposureModel> models;
+	for (int i = 0; i < nImages; ++i) {
+		const double *xi = &x[i * B];
+		cv::Vec3f gain = cv::Vec3f(float(std::exp(xi[0])), float(std::exp(xi[1])), float(std::exp(xi[2])));
+		const float k[3] = { float(xi[3]), float(xi[4]), float(xi[5]) };
+		models.push_back(ExposureModel(gain, k, images[i].size()));
+	}
+	return models;
+}
+
+// <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<< Vignetting <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
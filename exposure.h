@@ -0,0 +1,64 @@
+#pragma once
+#include "overlap.h"
+#include <opencv2/core.hpp>
+#include <algorithm>
+#include <memory>
+#include <vector>
+// exposure compensation: brings the brightness of overlapping images into agreement.
+
+// Solves for the per-channel gains of all images at once, after Brown and Lowe,
+// "Automatic Panoramic Image Stitching using Invariant Features". For every edge of _graph_
+// the gained average colors of the overlap should agree, and every gain should stay close to 1:
+//   e = sum_{edges} N_ij * |g_i I_ij - g_j I_ji|^2 / sigmaN^2  +  sum_i N_i * |1 - g_i|^2 / sigmaG^2
+// where I_ij and I_ji are the average colors of the edge (computeOverlapStats), N_ij the mean
+// of its two pixel counts, and N_i the total overlap of image _i_. Each channel is a sparse
+// linear system with one row per image and one pair of off-diagonal entries per edge, solved
+// once by conjugate gradients, so the cost grows with the number of edges.
+// _sigmaN_ is in the units of the image colors (here 0 to 1).
+std::vector<cv::Vec3f> solveGains(int nImages, const OverlapGraph & graph,
+	float sigmaN = 10.0f / 255.0f, float sigmaG = 0.1f);
+
+// Photometric model of one camera: the colors it records are the scene colors darkened
+// towards the corners by a radial falloff (vignetting) and divided by a per-channel gain,
+//   recorded(x, y) = scene(x, y) * V(r) / gain,    V(r) = exp(k1 r^2 + k2 r^4 + k3 r^6),
+// where _r_ is the distance from (x, y) to the image center over half the image diagonal.
+// The compositor applies correct() to every sample it reads, so compensating the exposure
+// takes no pass over the images of its own.
+class ExposureModel {
+public:
+	cv::Vec3f gain;
+	float vignetting[3];	// k1, k2, k3
+
+	// gain 1 and no vignetting.
+	ExposureModel();
+	explicit ExposureModel(const cv::Vec3f & gain);
+	ExposureModel(const cv::Vec3f & gain, const float vignetting[3], cv::Size imSize);
+
+	// Scene color of a pixel that the camera recorded as _color_ at image position (x, y).
+	cv::Vec3f correct(const cv::Vec3f & color, float x, float y) const {
+		float dx = x - cx, dy = y - cy;
+		float s = std::min((dx * dx + dy * dy) * invRadius2, 1.0f) * (FALLOFF_TABLE_SIZE - 1);
+		int k = std::min(int(s), FALLOFF_TABLE_SIZE - 2);
+		float f = falloff[k] + (falloff[k + 1] - falloff[k]) * (s - k);
+		return color.mul(gain) * f;
+	}
+
+private:
+	// 1 / V tabulated over r^2 in [0, 1], so correct() only interpolates.
+	static const int FALLOFF_TABLE_SIZE = 65;
+	float falloff[FALLOFF_TABLE_SIZE];
+	float cx, cy, invRadius2;
+};
+
+// Fits the gains and vignetting of all cameras jointly, from correspondences sampled every
+// _stride_ pixels in the overlap of every edge of _graph_ (edges are sampled in parallel).
+// Every correspondence asks for equal scene colors in log space, which is linear in the
+// log gains and in k1..k3:
+//   log g_i + log I_i - log V_i(r_i)  =  log g_j + log I_j - log V_j(r_j),
+// with deviations weighted by 1 / _sigmaN_^2 (noise in log intensity), plus priors that keep
+// log gains near 0 (_sigmaG_) and k1..k3 near 0 (_sigmaV_). Samples that are nearly black or
+// saturated in any channel are skipped. The system couples the 6 unknowns of every camera with
+// those of its neighbors only and is solved like the one of solveGains.
+std::vector<ExposureModel> fitExposure(const std::vector< std::unique_ptr<PPC> > & cameras,
+	const std::vector<cv::Mat> & images, const OverlapGraph & graph, int stride = 8,
+	float sigmaN = 0.05f, float sigmaG = 0.3f, float sigmaV = 0.5f);
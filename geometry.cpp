@@ -3,6 +3,7 @@
 //#include <iostream>
 #include <iomanip>
 #include <cassert>
+#include <algorithm>
 
 // >>>>>>>>>>>>>>>>>>>>>>>>>>>>> HELPERS >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
 static inline constexpr float TO_RADIAN(float degree) {
@@ -14,91 +15,6 @@ static inline constexpr float TO_DEGREE(float radian) {
 }
 // <<<<<<<<<<<<<<<<<<<<<<<<<<<<< HELPERS <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
 
-Vector3f::Vector3f() : x(0), y(0), z(0) {}
-Vector3f::Vector3f(float _x, float _y, float _z) :
-	x{ _x }, y{ _y }, z{ _z } {}
-Vector3f::Vector3f(const Point3f &p) :
-	x{ p.x }, y{ p.y }, z{ p.z } {}
-
-Vector3f Vector3f::operator+(const Vector3f & rhs) const
-{
-	return Vector3f{ x + rhs.x, y + rhs.y, z + rhs.z };
-}
-
-Vector3f Vector3f::operator-(const Vector3f & rhs) const {
-	return Vector3f{x - rhs.x, y - rhs.y, z - rhs.z};
-}
-
-Vector3f Vector3f::operator*(float s) const {
-	return Vector3f{ x*s, y*s, z*s };
-}
-
-Vector3f Vector3f::operator/(float s) const {
-	float inv = 1.0f / s;
-	return Vector3f{ x*inv, y*inv, z*inv };
-}
-
-
-Vector3f & Vector3f::operator += (const Vector3f & rhs) {
-	x += rhs.x; y += rhs.y; z += rhs.z;
-	return *this;
-}
-
-Vector3f & Vector3f::operator -= (const Vector3f & rhs) {
-	x -= rhs.x; y -= rhs.y; z -= rhs.z;
-	return *this;
-}
-
-Vector3f & Vector3f::operator*=(float s) {
-	x *= s; y *= s; z *= s;
-	return *this;
-}
-
-Vector3f & Vector3f::operator/=(float s) {
-	float inv = 1.0 / s;
-	x *= inv; y *= inv; z *= inv;
-	return *this;
-}
-
-// dot product
-float Vector3f::operator*(const Vector3f & rhs) const {
-	return x * rhs.x + y * rhs.y + z * rhs.z;
-}
-
-Vector3f Vector3f::operator^(const Vector3f & rhs) const
-{
-	/* | x | y | z |
-	   | x'| y'| z'|
-	   | i | j | k |
-	*/
-	float nx = y * rhs.z - z * rhs.y;
-	float ny = z * rhs.x - x * rhs.z;
-	float nz = x * rhs.y - y * rhs.x;
-	return Vector3f{ nx, ny, nz };
-}
-
-Vector3f Vector3f::operator - () const {
-	return Vector3f{ -x, -y, -z };
-}
-
-float Vector3f::length() const {
-	return std::sqrt(x * x + y * y + z * z);
-}
-
-void Vector3f::normalize() {
-	float l = this->length();
-	if (l >= 0.0001f) {
-		float inv = 1.0 / l;
-		x *= inv; y *= inv; z *= inv;
-	}
-}
-
-Vector3f Vector3f::normalized() const {
-	float l = this->length();
-	if (l < 0.0001f) return *this;
-	else return (*this) / l;
-}
-
 // static const for Vector
 const Vector3f Vector3f::XBASE{ 1.0, 0.0, 0.0 };
 const Vector3f Vector3f::YBASE{ 0.0, 1.0, 0.0 };
@@ -107,156 +23,14 @@ const Vector3f &Vector3f::XDIR = XBASE;
 const Vector3f &Vector3f::YDIR = YBASE;
 const Vector3f &Vector3f::ZDIR = ZBASE;
 
-// scalar * v
-Vector3f operator*(float s, const Vector3f & v) {
-	return v * s;
-}
-
-
 // >>>>>>>>>>>>>>>>>>>>>>>>>> Point3f >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
 
-Point3f::Point3f() : x(0), y(0), z(0) {}
-
-Point3f::Point3f(float _x, float _y, float _z) : x(_x), y(_y), z(_z) {}
-
-Point3f::Point3f(const Vector3f &v) : x(v.x), y(v.y), z(v.z) {}
-
-Point3f Point3f::operator+(const Vector3f & rhs) const {
-	return Point3f{ x + rhs.x, y + rhs.y, z + rhs.z };
-}
-
-Point3f Point3f::operator-(const Vector3f & rhs) const {
-	return Point3f{ x - rhs.x, y - rhs.y, z - rhs.z };
-}
-
-Point3f & Point3f::operator += (const Vector3f & v) {
-	x += v.x; y += v.y; z += v.z;
-	return *this;
-}
-
-Point3f & Point3f::operator -= (const Vector3f & v) {
-	x -= v.x; y -= v.y; z -= v.z;
-	return *this;
-}
-
-Vector3f Point3f::operator-(const Point3f & rhs) const {
-	return Vector3f{x - rhs.x, y - rhs.y, z - rhs.z};
-}
-
 const Point3f Point3f::ORIGIN{ 0.0f, 0.0f, 0.0f };
 
 // <<<<<<<<<<<<<<<<<<<<<<<<<<< Point3f <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
 
-// v + p
-
-Point3f operator + (const Vector3f & v, const Point3f & p) {
-	return p + v;
-}
-
-
 // >>>>>>>>>>>>>>>>>>>>>>>>>> Natrix3f class >>>>>>>>>>>>>>>>>>>>>>>>>
 
-Matrix3f::Matrix3f() {
-	columns[0].x = columns[1].y = columns[2].z = 1.0f;
-}
-
-Matrix3f::Matrix3f(const Vector3f &a, const Vector3f &b, const Vector3f &c) {
-	columns[0] = a;
-	columns[1] = b;
-	columns[2] = c;
-}
-
-Matrix3f Matrix3f::operator + (const Matrix3f & rhs) const {
-	return Matrix3f{
-		columns[0] + rhs.columns[0],
-		columns[1] + rhs.columns[1],
-		columns[2] + rhs.columns[2]
-	};
-}
-
-Matrix3f Matrix3f::operator - (const Matrix3f & rhs) const {
-	return Matrix3f{
-		columns[0] - rhs.columns[0],
-		columns[1] - rhs.columns[1],
-		columns[2] - rhs.columns[2]
-	};
-}
-
-Matrix3f Matrix3f::operator * (const Matrix3f &rhs) const {
-	return Matrix3f{
-		(*this)*rhs.columns[0],
-		(*this)*rhs.columns[1],
-		(*this)*rhs.columns[2]
-	};
-}
-
-
-
-Matrix3f & Matrix3f::operator += (const Matrix3f & rhs) {
-	columns[0] += rhs.columns[0];
-	columns[1] += rhs.columns[1];
-	columns[2] += rhs.columns[2];
-	return *this;
-}
-
-Matrix3f & Matrix3f::operator -= (const Matrix3f & rhs) {
-	columns[0] -= rhs.columns[0];
-	columns[1] -= rhs.columns[1];
-	columns[2] -= rhs.columns[2];
-	return *this;
-}
-
-Matrix3f & Matrix3f::operator *= (const Matrix3f & rhs) {
-	Matrix3f temp = (*this) * rhs;
-	(*this) = temp;
-	return *this;
-}
-
-Vector3f Matrix3f::operator*(const Vector3f & v) const {
-	return columns[0] * v.x + columns[1] * v.y + columns[2] * v.z;
-}
-
-Vector3f Matrix3f::row(int x) const {
-	return Vector3f{ columns[0][x], columns[1][x], columns[2][x] };
-}
-
-void Matrix3f::transpose() {
-#define SWAP_CODE9527(a, b) \
-	do {decltype(a) t = b; b = a; a = t;} while (0)
-	SWAP_CODE9527(columns[0].y, columns[1].x);
-	SWAP_CODE9527(columns[0].z, columns[2].x);
-	SWAP_CODE9527(columns[1].z, columns[2].y);
-#undef SWAP_CODE9527
-}
-
-Matrix3f Matrix3f::transposed() const
-{
-	return Matrix3f{
-		Vector3f{columns[0].x, columns[1].x, columns[2].x},
-		Vector3f{ columns[0].y, columns[1].y, columns[2].y },
-		Vector3f{ columns[0].z, columns[1].z, columns[2].z }
-	};
-}
-
-void Matrix3f::invert() {
-	// I copied this code from Dr. Popescu
-	const Vector3f a = row(0), b = row(1), c = row(2);
-	Vector3f _a = b ^ c; _a /= (a * _a);
-	Vector3f _b = c ^ a; _b /= (b * _b);
-	Vector3f _c = a ^ b; _c /= (c * _c);
-	columns[0] = _a; columns[1] = _b; columns[2] = _c;
-}
-
-Matrix3f Matrix3f::inverted() const
-{
-	const Vector3f a = row(0), b = row(1), c = row(2);
-	Vector3f _a = b ^ c; _a /= (a * _a);
-	Vector3f _b = c ^ a; _b /= (b * _b);
-	Vector3f _c = a ^ b; _c /= (c * _c);
-
-	return Matrix3f{_a, _b, _c};
-}
-
 // static methods
 Matrix3f Matrix3f::rotateX(float degree) {
 	float radian = TO_RADIAN(degree);
@@ -324,12 +98,62 @@ Matrix3f Matrix3f::lookAt(const Point3f & origin, const Vector3f & viewDir, cons
 	return Matrix3f{ x, y, z };
 }
 
-float Matrix3f::frobeniusNorm() const
-{
-	return std::sqrt(
-		columns[0].lengthSquared() + columns[1].lengthSquared() + columns[2].lengthSquared());
+// >>>>>>>>>>>>>>>>>>>>>>>>>> batch transforms >>>>>>>>>>>>>>>>>>>>>>>>>
+
+// Divides the homogeneous points (px, py, pz) of batch entries [k, k + 4) and records which are valid.
+static inline void projectFour(__m128 px, __m128 py, __m128 pz, int k, float *u, float *v, std::uint32_t *valid) {
+	__m128 invZ = _mm_div_ps(_mm_set1_ps(1.0f), pz);
+	_mm_storeu_ps(u + k, _mm_mul_ps(px, invZ));
+	_mm_storeu_ps(v + k, _mm_mul_ps(py, invZ));
+	std::uint32_t bits = std::uint32_t(_mm_movemask_ps(_mm_cmpgt_ps(pz, _mm_setzero_ps())));
+	valid[k >> 5] |= bits << (k & 31);
+}
+
+// scalar counterpart of projectFour, computing the same results bit for bit.
+static inline void projectOne(float px, float py, float pz, int k, float *u, float *v, std::uint32_t *valid) {
+	float invZ = 1.0f / pz;
+	u[k] = px * invZ;
+	v[k] = py * invZ;
+	if (pz > 0.0f) valid[k >> 5] |= 1u << (k & 31);
+}
+
+void Matrix3f::projectBatch(const float *x, const float *y, const float *z, int n, float *u, float *v, std::uint32_t *valid) const {
+	std::fill(valid, valid + (n + 31) / 32, 0u);
+	const Vector3f &c0 = columns[0], &c1 = columns[1], &c2 = columns[2];
+	int k = 0;
+	for (; k + 4 <= n; k += 4) {
+		__m128 vx = _mm_loadu_ps(x + k), vy = _mm_loadu_ps(y + k), vz = _mm_loadu_ps(z + k);
+		auto row = [&](float a, float b, float c) {
+			return _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(a), vx), _mm_mul_ps(_mm_set1_ps(b), vy)), _mm_mul_ps(_mm_set1_ps(c), vz));
+		};
+		projectFour(row(c0.x, c1.x, c2.x), row(c0.y, c1.y, c2.y), row(c0.z, c1.z, c2.z), k, u, v, valid);
+	}
+	for (; k < n; ++k) {
+		projectOne(c0.x * x[k] + c1.x * y[k] + c2.x * z[k], c0.y * x[k] + c1.y * y[k] + c2.y * z[k],
+			c0.z * x[k] + c1.z * y[k] + c2.z * z[k], k, u, v, valid);
+	}
+}
+
+void Matrix3f::projectRow(float x0, float y, int n, float *u, float *v, std::uint32_t *valid) const {
+	std::fill(valid, valid + (n + 31) / 32, 0u);
+	// p(k) = base + k * columns[0], evaluated directly rather than accumulated, so no error builds up along the row.
+	const Vector3f &d = columns[0];
+	const Vector3f base = (*this) * Vector3f{ x0, y, 1.0f };
+	const __m128 bx = _mm_set1_ps(base.x), by = _mm_set1_ps(base.y), bz = _mm_set1_ps(base.z);
+	const __m128 dx = _mm_set1_ps(d.x), dy = _mm_set1_ps(d.y), dz = _mm_set1_ps(d.z);
+	__m128 vk = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+	int k = 0;
+	for (; k + 4 <= n; k += 4, vk = _mm_add_ps(vk, _mm_set1_ps(4.0f))) {
+		projectFour(_mm_add_ps(bx, _mm_mul_ps(dx, vk)), _mm_add_ps(by, _mm_mul_ps(dy, vk)), _mm_add_ps(bz, _mm_mul_ps(dz, vk)),
+			k, u, v, valid);
+	}
+	for (; k < n; ++k) {
+		float fk = float(k);
+		projectOne(base.x + d.x * fk, base.y + d.y * fk, base.z + d.z * fk, k, u, v, valid);
+	}
 }
 
+// <<<<<<<<<<<<<<<<<<<<<<<<<< batch transforms <<<<<<<<<<<<<<<<<<<<<<<<<
 
 const Matrix3f Matrix3f::IDENTITY{ Vector3f::XBASE, Vector3f::YBASE, Vector3f::ZBASE };
 
@@ -1,40 +1,60 @@
 #pragma once
+#include <cmath>
+#include <cstdint>
 #include <iosfwd>
+#include <xmmintrin.h>
+
+// All arithmetic on these types is defined in this header so that it inlines into the per-pixel
+// loops of the kernels. Functions are constexpr where a single expression suffices (the C++11
+// rules, which is what the v140 toolset implements); geometry.cpp only keeps the constants,
+// the rotation builders and the stream operators.
 
 class Point3f;
 
 class Vector3f {
 public:
 	float x, y, z;
-	Vector3f();
-	Vector3f(float, float, float);
-	explicit Vector3f(const Point3f &);
-	float & operator [] (int i)       { return (&x)[i]; }
-	float   operator [] (int i) const { return (&x)[i]; }
-
-	Vector3f operator + (const Vector3f & rhs) const;
-	Vector3f operator - (const Vector3f & rhs) const;
-	Vector3f operator * (float s) const;
-	Vector3f operator / (float s) const;
-
-	Vector3f & operator += (const Vector3f & rhs);
-	Vector3f & operator -= (const Vector3f & rhs);
-	Vector3f & operator *= (float s);
-	Vector3f & operator /= (float s);
+	constexpr Vector3f() noexcept : x(0), y(0), z(0) {}
+	constexpr Vector3f(float _x, float _y, float _z) noexcept : x{ _x }, y{ _y }, z{ _z } {}
+	explicit inline Vector3f(const Point3f &) noexcept;
+	float & operator [] (int i)       noexcept { return (&x)[i]; }
+	float   operator [] (int i) const noexcept { return (&x)[i]; }
+
+	constexpr Vector3f operator + (const Vector3f & rhs) const noexcept { return Vector3f{ x + rhs.x, y + rhs.y, z + rhs.z }; }
+	constexpr Vector3f operator - (const Vector3f & rhs) const noexcept { return Vector3f{ x - rhs.x, y - rhs.y, z - rhs.z }; }
+	constexpr Vector3f operator * (float s) const noexcept { return Vector3f{ x*s, y*s, z*s }; }
+	constexpr Vector3f operator / (float s) const noexcept { return (*this) * (1.0f / s); }
+
+	Vector3f & operator += (const Vector3f & rhs) noexcept { x += rhs.x; y += rhs.y; z += rhs.z; return *this; }
+	Vector3f & operator -= (const Vector3f & rhs) noexcept { x -= rhs.x; y -= rhs.y; z -= rhs.z; return *this; }
+	Vector3f & operator *= (float s) noexcept { x *= s; y *= s; z *= s; return *this; }
+	Vector3f & operator /= (float s) noexcept { return (*this) *= 1.0f / s; }
 
 	// Dot-product and cross-product
-	float    operator * (const Vector3f & rhs) const;
-	Vector3f operator ^ (const Vector3f & rhs) const;
-	float    dot(const Vector3f & rhs) const { return (*this)*rhs; }
-	Vector3f cross(const Vector3f & rhs) const { return (*this) ^ rhs; }
+	constexpr float    operator * (const Vector3f & rhs) const noexcept { return x * rhs.x + y * rhs.y + z * rhs.z; }
+	/* | x | y | z |
+	   | x'| y'| z'|
+	   | i | j | k |
+	*/
+	constexpr Vector3f operator ^ (const Vector3f & rhs) const noexcept {
+		return Vector3f{ y * rhs.z - z * rhs.y, z * rhs.x - x * rhs.z, x * rhs.y - y * rhs.x };
+	}
+	constexpr float    dot(const Vector3f & rhs) const noexcept { return (*this)*rhs; }
+	constexpr Vector3f cross(const Vector3f & rhs) const noexcept { return (*this) ^ rhs; }
 
 	// return vector in opposite direction
-	Vector3f operator - () const;
+	constexpr Vector3f operator - () const noexcept { return Vector3f{ -x, -y, -z }; }
 
-	float length() const;
-	float lengthSquared() const { return x*x + y*y + z*z; }
-	void normalize();
-	Vector3f normalized() const;
+	float length() const noexcept { return std::sqrt(lengthSquared()); }
+	constexpr float lengthSquared() const noexcept { return x*x + y*y + z*z; }
+	void normalize() noexcept {
+		float l = length();
+		if (l >= 0.0001f) (*this) *= 1.0f / l;
+	}
+	Vector3f normalized() const noexcept {
+		float l = length();
+		return l < 0.0001f ? *this : (*this) / l;
+	}
 
 
 	static const Vector3f XBASE;
@@ -45,7 +65,8 @@ public:
 	static const Vector3f &ZDIR;
 };
 
-Vector3f operator * (float s, const Vector3f & v);
+// scalar * v
+constexpr Vector3f operator * (float s, const Vector3f & v) noexcept { return v * s; }
 
 
 // class Point3f
@@ -53,63 +74,108 @@ Vector3f operator * (float s, const Vector3f & v);
 class Point3f {
 public:
 	float x, y, z;
-	Point3f();
-	Point3f(float, float, float);
-	explicit Point3f(const Vector3f &);
+	constexpr Point3f() noexcept : x(0), y(0), z(0) {}
+	constexpr Point3f(float _x, float _y, float _z) noexcept : x(_x), y(_y), z(_z) {}
+	constexpr explicit Point3f(const Vector3f & v) noexcept : x(v.x), y(v.y), z(v.z) {}
 
-	float & operator [] (int i) { return (&x)[i]; }
-	float   operator [] (int i) const { return (&x)[i]; }
+	float & operator [] (int i) noexcept { return (&x)[i]; }
+	float   operator [] (int i) const noexcept { return (&x)[i]; }
 
 	// point +/+= vec, point -/-= vec
-	Point3f operator + (const Vector3f & rhs) const;
-	Point3f operator - (const Vector3f & rhs) const;
+	constexpr Point3f operator + (const Vector3f & rhs) const noexcept { return Point3f{ x + rhs.x, y + rhs.y, z + rhs.z }; }
+	constexpr Point3f operator - (const Vector3f & rhs) const noexcept { return Point3f{ x - rhs.x, y - rhs.y, z - rhs.z }; }
 
-	Point3f & operator += (const Vector3f & rhs);
-	Point3f & operator -= (const Vector3f & rhs);
+	Point3f & operator += (const Vector3f & rhs) noexcept { x += rhs.x; y += rhs.y; z += rhs.z; return *this; }
+	Point3f & operator -= (const Vector3f & rhs) noexcept { x -= rhs.x; y -= rhs.y; z -= rhs.z; return *this; }
 
 	// point - point
-	Vector3f operator - (const Point3f & rhs) const;
+	constexpr Vector3f operator - (const Point3f & rhs) const noexcept { return Vector3f{ x - rhs.x, y - rhs.y, z - rhs.z }; }
 
 	// static methods
-	static Point3f origin() { return Point3f(); }
+	static constexpr Point3f origin() noexcept { return Point3f(); }
 	static const Point3f ORIGIN;
 };
 
-Point3f operator + (const Vector3f & v, const Point3f & p);
+inline Vector3f::Vector3f(const Point3f & p) noexcept : x{ p.x }, y{ p.y }, z{ p.z } {}
+
+// v + p
+constexpr Point3f operator + (const Vector3f & v, const Point3f & p) noexcept { return p + v; }
 
 class Matrix3f {
 public:
 	Vector3f columns[3];
 
-	Matrix3f();
-	Matrix3f(const Vector3f &c0, const Vector3f &c1, const Vector3f &c2);
+	constexpr Matrix3f() noexcept : columns{ Vector3f{ 1, 0, 0 }, Vector3f{ 0, 1, 0 }, Vector3f{ 0, 0, 1 } } {}
+	constexpr Matrix3f(const Vector3f &c0, const Vector3f &c1, const Vector3f &c2) noexcept : columns{ c0, c1, c2 } {}
 
 	// I don't think M+N, M-N will be used a lot...
-	Matrix3f operator + (const Matrix3f & rhs) const;
-	Matrix3f operator - (const Matrix3f & rhs) const;
-	Matrix3f operator * (const Matrix3f & rhs) const;
+	constexpr Matrix3f operator + (const Matrix3f & rhs) const noexcept {
+		return Matrix3f{ columns[0] + rhs.columns[0], columns[1] + rhs.columns[1], columns[2] + rhs.columns[2] };
+	}
+	constexpr Matrix3f operator - (const Matrix3f & rhs) const noexcept {
+		return Matrix3f{ columns[0] - rhs.columns[0], columns[1] - rhs.columns[1], columns[2] - rhs.columns[2] };
+	}
+	constexpr Matrix3f operator * (const Matrix3f & rhs) const noexcept {
+		return Matrix3f{ (*this)*rhs.columns[0], (*this)*rhs.columns[1], (*this)*rhs.columns[2] };
+	}
 
 	// multiplication is in the order of (*this) * (rhs).
 
-	Vector3f operator * (const Vector3f & v) const;
+	constexpr Vector3f operator * (const Vector3f & v) const noexcept {
+		return columns[0] * v.x + columns[1] * v.y + columns[2] * v.z;
+	}
 
-	Matrix3f & operator += (const Matrix3f & rhs);
-	Matrix3f & operator -= (const Matrix3f & rhs);
-	Matrix3f & operator *= (const Matrix3f & rhs);
+	Matrix3f & operator += (const Matrix3f & rhs) noexcept {
+		columns[0] += rhs.columns[0]; columns[1] += rhs.columns[1]; columns[2] += rhs.columns[2];
+		return *this;
+	}
+	Matrix3f & operator -= (const Matrix3f & rhs) noexcept {
+		columns[0] -= rhs.columns[0]; columns[1] -= rhs.columns[1]; columns[2] -= rhs.columns[2];
+		return *this;
+	}
+	Matrix3f & operator *= (const Matrix3f & rhs) noexcept { return (*this) = (*this) * rhs; }
 
 	// one can only get a copy of a row of matrix
-	Vector3f   row(int x) const;
+	Vector3f   row(int x) const noexcept { return Vector3f{ columns[0][x], columns[1][x], columns[2][x] }; }
 
 	// however a reference to a column is accessible.
-	Vector3f & col(int x) { return columns[x]; }
-	const Vector3f & col(int x) const { return columns[x]; }
-
-	void transpose();
-	Matrix3f transposed() const;
-	void invert();
-	Matrix3f inverted() const;
-
-	float frobeniusNorm() const;
+	Vector3f & col(int x) noexcept { return columns[x]; }
+	const Vector3f & col(int x) const noexcept { return columns[x]; }
+
+	void transpose() noexcept { (*this) = transposed(); }
+	constexpr Matrix3f transposed() const noexcept {
+		return Matrix3f{
+			Vector3f{ columns[0].x, columns[1].x, columns[2].x },
+			Vector3f{ columns[0].y, columns[1].y, columns[2].y },
+			Vector3f{ columns[0].z, columns[1].z, columns[2].z }
+		};
+	}
+	void invert() noexcept { (*this) = inverted(); }
+	Matrix3f inverted() const noexcept {
+		// I copied this code from Dr. Popescu
+		const Vector3f a = row(0), b = row(1), c = row(2);
+		Vector3f _a = b ^ c; _a /= (a * _a);
+		Vector3f _b = c ^ a; _b /= (b * _b);
+		Vector3f _c = a ^ b; _c /= (c * _c);
+		return Matrix3f{ _a, _b, _c };
+	}
+
+	float frobeniusNorm() const noexcept {
+		return std::sqrt(columns[0].lengthSquared() + columns[1].lengthSquared() + columns[2].lengthSquared());
+	}
+
+	// >>>> batch transforms >>>>
+	// Structure-of-arrays versions of (*this) * p followed by the perspective divide, for kernels
+	// that project many points at once: four points per SSE instruction, then the rest one by one.
+	// For every point _k_, u[k] and v[k] receive p.x / p.z and p.y / p.z, and bit k % 32 of
+	// valid[k / 32] (see batchValid) whether p.z > 0; u[k] and v[k] are meaningless where it is not.
+	// _valid_ must hold (n + 31) / 32 words.
+
+	// projects the points (x[k], y[k], z[k]).
+	void projectBatch(const float *x, const float *y, const float *z, int n, float *u, float *v, std::uint32_t *valid) const;
+	// projects the points (x0 + k, y, 1), e.g. the pixel centers of a row of an image.
+	void projectRow(float x0, float y, int n, float *u, float *v, std::uint32_t *valid) const;
+	// <<<< batch transforms <<<<
 
 	static Matrix3f rotateX(float degree);
 	static Matrix3f rotateY(float degree);
@@ -122,6 +188,62 @@ public:
 	static const Matrix3f IDENTITY;
 };
 
+// whether point _k_ of a batch transform was in front of the camera.
+inline bool batchValid(const std::uint32_t *valid, int k) noexcept {
+	return (valid[k >> 5] >> (k & 31)) & 1u;
+}
+
+// >>>>>>>>>>>>>>>>>>>>>>>>>>>>> SSE >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
+
+// Vector3f padded to a whole SSE register, for kernels that keep their points in registers.
+// The fourth lane is padding and stays 0.
+struct Vector4f {
+	__m128 v;
+
+	Vector4f() noexcept : v(_mm_setzero_ps()) {}
+	explicit Vector4f(__m128 _v) noexcept : v(_v) {}
+	explicit Vector4f(const Vector3f & u) noexcept : v(_mm_set_ps(0.0f, u.z, u.y, u.x)) {}
+
+	Vector3f toVector3f() const noexcept {
+		float f[4];
+		_mm_storeu_ps(f, v);
+		return Vector3f{ f[0], f[1], f[2] };
+	}
+
+	Vector4f operator + (const Vector4f & rhs) const noexcept { return Vector4f(_mm_add_ps(v, rhs.v)); }
+	Vector4f operator - (const Vector4f & rhs) const noexcept { return Vector4f(_mm_sub_ps(v, rhs.v)); }
+	Vector4f operator * (float s) const noexcept { return Vector4f(_mm_mul_ps(v, _mm_set1_ps(s))); }
+	Vector4f & operator += (const Vector4f & rhs) noexcept { v = _mm_add_ps(v, rhs.v); return *this; }
+
+	float dot(const Vector4f & rhs) const noexcept {
+		__m128 p = _mm_mul_ps(v, rhs.v);
+		__m128 s = _mm_add_ps(p, _mm_movehl_ps(p, p));
+		return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(s, s, _MM_SHUFFLE(1, 1, 1, 1))));
+	}
+};
+
+// Matrix3f with padded columns, so that a product is three multiply-adds of whole registers.
+struct Matrix3x4f {
+	__m128 columns[3];
+
+	explicit Matrix3x4f(const Matrix3f & m) noexcept {
+		for (int k = 0; k < 3; ++k) columns[k] = Vector4f(m.columns[k]).v;
+	}
+
+	Vector4f operator * (const Vector4f & u) const noexcept {
+		__m128 x = _mm_shuffle_ps(u.v, u.v, _MM_SHUFFLE(0, 0, 0, 0));
+		__m128 y = _mm_shuffle_ps(u.v, u.v, _MM_SHUFFLE(1, 1, 1, 1));
+		__m128 z = _mm_shuffle_ps(u.v, u.v, _MM_SHUFFLE(2, 2, 2, 2));
+		return Vector4f(_mm_add_ps(_mm_add_ps(_mm_mul_ps(columns[0], x), _mm_mul_ps(columns[1], y)), _mm_mul_ps(columns[2], z)));
+	}
+	// the product with the homogeneous point (x, y, 1), as used for pixel coordinates.
+	Vector4f operator () (float x, float y) const noexcept {
+		return Vector4f(_mm_add_ps(_mm_add_ps(_mm_mul_ps(columns[0], _mm_set1_ps(x)), _mm_mul_ps(columns[1], _mm_set1_ps(y))), columns[2]));
+	}
+};
+
+// <<<<<<<<<<<<<<<<<<<<<<<<<<<<< SSE <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+
 std::ostream & operator << (std::ostream &, const Point3f & p);
 std::ostream & operator << (std::ostream &, const Vector3f & v);
-std::ostream & operator << (std::ostream &, const Matrix3f & m);
\ No newline at end of file
+std::ostream & operator << (std::ostream &, const Matrix3f & m);
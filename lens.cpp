@@ -0,0 +1,57 @@
+#include "lens.h"
+#include "geometry.h"
+#include <cassert>
+#include <cmath>
+#include <fstream>
+
+cv::Point2f LensDistortion::distort(cv::Point2f p) const {
+	float x2 = p.x * p.x, y2 = p.y * p.y, xy = p.x * p.y;
+	float r2 = x2 + y2;
+	float radial = 1.0f + r2 * (k1 + r2 * (k2 + r2 * k3));
+	return cv::Point2f(
+		p.x * radial + 2.0f * p1 * xy + p2 * (r2 + 2.0f * x2),
+		p.y * radial + p1 * (r2 + 2.0f * y2) + 2.0f * p2 * xy);
+}
+
+bool loadLensDistortion(const std::string & filename, LensDistortion & distortion) {
+	std::ifstream ifs(filename);
+	LensDistortion d;
+	if (!(ifs >> d.k1 >> d.k2 >> d.k3 >> d.p1 >> d.p2))
+		return false;
+	distortion = d;
+	return true;
+}
+
+UndistortionMap::UndistortionMap(const LensDistortion & distortion, cv::Size size, float cx, float cy, float focal)
+	: imageSize(size)
+{
+	assert(size.width > 0 && size.height > 0 && focal > 0);
+	// enough nodes to reach the far border of the image.
+	gridCols = (size.width + UNDISTORTION_GRID_STEP - 1) / UNDISTORTION_GRID_STEP + 1;
+	gridRows = (size.height + UNDISTORTION_GRID_STEP - 1) / UNDISTORTION_GRID_STEP + 1;
+	grid.resize(gridCols * gridRows);
+
+	const float invFocal = 1.0f / focal;
+	for (int r = 0; r < gridRows; ++r) {
+		for (int c = 0; c < gridCols; ++c) {
+			cv::Point2f p((c * UNDISTORTION_GRID_STEP - cx) * invFocal, (r * UNDISTORTION_GRID_STEP - cy) * invFocal);
+			cv::Point2f d = distortion.distort(p);
+			grid[r * gridCols + c] = cv::Point2f(cx + d.x * focal, cy + d.y * focal);
+		}
+	}
+}
+
+void UndistortionMap::apply(float *x, float *y, std::uint32_t *valid, int n) const {
+	const float w = float(imageSize.width), h = float(imageSize.height);
+	for (int k = 0; k < n; ++k) {
+		if (!batchValid(valid, k))
+			continue;
+		if (!(x[k] >= 0.0f && x[k] <= w && y[k] >= 0.0f && y[k] <= h)) {
+			valid[k >> 5] &= ~(1u << (k & 31));
+			continue;
+		}
+		cv::Point2f p = (*this)(x[k], y[k]);
+		x[k] = p.x;
+		y[k] = p.y;
+	}
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+// lens distortion of the source images.
+
+// Brown-Conrady model: radial coefficients k1, k2, k3 and tangential coefficients p1, p2,
+// applied to positions centered on the principal point and divided by the focal length.
+// All zero (the default) is an ideal pinhole.
+struct LensDistortion {
+	float k1 = 0.0f, k2 = 0.0f, k3 = 0.0f;
+	float p1 = 0.0f, p2 = 0.0f;
+
+	bool isIdeal() const { return k1 == 0.0f && k2 == 0.0f && k3 == 0.0f && p1 == 0.0f && p2 == 0.0f; }
+
+	// where the lens moves the normalized position _p_ to.
+	cv::Point2f distort(cv::Point2f p) const;
+};
+
+// Reads "k1 k2 k3 p1 p2" (e.g. the coefficients cv::calibrateCamera reports, reordered) from
+// a text file into _distortion_. Returns false if the file cannot be opened or parsed.
+bool loadLensDistortion(const std::string & filename, LensDistortion & distortion);
+
+// grid spacing of UndistortionMap, in pixels.
+constexpr int UNDISTORTION_GRID_STEP = 16;
+
+// For the ideal pinhole image of a camera (what PPC models), the position in the captured image
+// that the lens moves every pixel to. The kernels read captured images through it directly,
+// so no undistorted copy of an image is ever made. The map is tabulated on a grid of
+// UNDISTORTION_GRID_STEP pixels and interpolated bilinearly; the distortion varies slowly
+// enough that this is accurate to a small fraction of a pixel.
+//
+// The ideal image has the size of the captured one. Where the lens pulls the corners inwards
+// (barrel distortion), the parts of the captured image outside the ideal frame are not used;
+// where it pushes them outwards, ideal pixels map outside the captured image and show nothing.
+class UndistortionMap {
+public:
+	// _size_ is the size of the image, (cx, cy) the principal point and _focal_ the focal
+	// length, all in pixels of the ideal image.
+	UndistortionMap(const LensDistortion & distortion, cv::Size size, float cx, float cy, float focal);
+
+	cv::Size size() const { return imageSize; }
+
+	// Position in the captured image of position (x, y) of the ideal image, where pixel
+	// (c, r) covers [c, c + 1) x [r, r + 1). (x, y) must lie in [0, w] x [0, h].
+	cv::Point2f operator () (float x, float y) const;
+
+	// Maps the _n_ positions (x[k], y[k]) whose bit is set in _valid_ (see batchValid) in place,
+	// and clears the bits of the positions outside the ideal image.
+	void apply(float *x, float *y, std::uint32_t *valid, int n) const;
+
+private:
+	cv::Size imageSize;
+	int gridCols, gridRows;
+	// gridRows x gridCols nodes; node (c, r) is the position of (c, r) * UNDISTORTION_GRID_STEP.
+	std::vector<cv::Point2f> grid;
+};
+
+inline cv::Point2f UndistortionMap::operator () (float x, float y) const {
+	const float INV_STEP = 1.0f / UNDISTORTION_GRID_STEP;
+	float gx = x * INV_STEP, gy = y * INV_STEP;
+	int c = std::min(int(gx), gridCols - 2), r = std::min(int(gy), gridRows - 2);
+	float fx = gx - c, fy = gy - r;
+	const cv::Point2f *node = &grid[r * gridCols + c];
+	cv::Point2f top = node[0] + (node[1] - node[0]) * fx;
+	cv::Point2f bottom = node[gridCols] + (node[gridCols + 1] - node[gridCols]) * fx;
+	return top + (bottom - top) * fy;
+}
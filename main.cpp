@@ -6,13 +6,19 @@
 #include "quaternion.h"
 #include "ppc.h"
 #include "optimize.h"
+#include "compositor.h"
+#include "tiledcanvas.h"
+#include "overlap.h"
+#include "exposure.h"
 
 #include "utilities/shader.h"
 
 
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <memory>
+#include <string>
 #include <utility>
 #include <opencv2/core.hpp>
 #include <opencv2/highgui.hpp>
@@ -39,14 +45,14 @@ std::unique_ptr<PPC> paintCamera;
 std::vector< std::unique_ptr<PPC> > cameras;
 PPC oldCamera{ WINDOW_WIDTH, WINDOW_HEIGHT, 90.0f };
 glm::mat4 projTrans, viewTrans, modelTrans;
-const cv::Vec3f BGCOLOR(0.01f, 0.01f, 0.01f);
 
 // textures
-GLuint midCubeTex, leftCubeTex, rightCubeTex, botTex;
+GLuint cubeTexs[CUBE_FACES];
 constexpr unsigned int CUBEMAP_SIZE = 1024;
-cv::Mat midCubeIm, leftCubeIm, rightCubeIm;
+// face size of the cube map DO_TILED_EXPORT writes to disk.
+constexpr unsigned int EXPORT_CUBEMAP_SIZE = 16384;
+cv::Mat cubeIms[CUBE_FACES];
 std::vector<cv::Mat> images;
-void drawImageOnCanvas(const PPC * viewPPC, cv::Mat & canvas, const PPC * refPPC, cv::Mat & refImage, float imGain = 1.0f);
 
 // scene objects: geometry objects
 GLuint rectVAO;
@@ -59,15 +65,15 @@ static glm::vec2 mouseLoc;
 
 
 
-// Image gain
-
-// computes how many pixels in im0 are overlapping with im1 (given size)
-// and computes the average color of the overlapping area in im0.
-std::pair<int, cv::Vec3f> ComputeImageOverlap(const PPC *ppc0, const cv::Mat &im0, const PPC * ppc1, cv::Size size1);
-
 #define SCENE 4
 
 #define DO_OPTIMIZE
+#define DO_PHASE_CORRELATION_INIT
+#define DO_MULTIBAND_BLENDING
+#define DO_SEAM_FINDING
+#define DO_VIGNETTING_CORRECTION
+//#define DO_LENS_DISTORTION
+//#define DO_TILED_EXPORT
 
 // ImGui Variables
 namespace imv {
@@ -76,6 +82,9 @@ namespace imv {
 	float HDRmax = 1.0f;
 	bool shouldAdjustHDRRange = false;
 	bool manualHDR = false;
+	int editedCamera = 1;
+	// faces that were only feather blended while a camera was dragged, and get the full blend on release.
+	bool facesToReblend[CUBE_FACES] = { false };
 };
 
 void autoAdjustHDRRange();
@@ -215,16 +224,6 @@ int main() {
 		}
 
 	}
-	midCubeIm = cv::Mat(CUBEMAP_SIZE, CUBEMAP_SIZE, CV_32FC3);
-	leftCubeIm = cv::Mat(CUBEMAP_SIZE, CUBEMAP_SIZE, CV_32FC3);
-	rightCubeIm = cv::Mat(CUBEMAP_SIZE, CUBEMAP_SIZE, CV_32FC3);
-	for (int r = 0; r < midCubeIm.rows; ++r) {
-		for (int c = 0; c < midCubeIm.cols; ++c) {
-			midCubeIm.at<cv::Vec3f>(r, c) = BGCOLOR;
-			leftCubeIm.at<cv::Vec3f>(r, c) = BGCOLOR;
-			rightCubeIm.at<cv::Vec3f>(r, c) = BGCOLOR;
-		}
-	}
 
 	//cv::imshow("right", images[0]);
 	//cv::imshow("bottom", images[2]);
@@ -253,117 +252,217 @@ int main() {
 		std::exit(1);
 	}
 
-	float imGains[nImages] = { 0.0f };
+	// exposure (gain and vignetting) of every image, corrected while sampling; the images themselves are never scaled.
+	std::vector<ExposureModel> exposures(nImages);
 	// >>>>>>>>>>>>>>>>>>>>>>>>> Find relative camera locations >>>>>>>>>>>>>>>>>>>>>>>>
 
-	for (int round = 0; round < 3; ++round) {
-		cameras[0].reset(new PPC{ images[0].cols, images[0].rows, hfov });
+	cameras[0].reset(new PPC{ images[0].cols, images[0].rows, hfov });
+#ifdef DO_LENS_DISTORTION
+	// Brown-Conrady coefficients of the phone lens, calibrated offline and stored next to the
+	// images; every camera below is copied from this one and shares its undistortion map.
+	{
+		std::string lensFN = std::string(prefix) + "lens.txt";
+		LensDistortion lens;
+		if (!loadLensDistortion(lensFN, lens)) {
+			std::cerr << "cannot read the lens distortion from '" << lensFN << "'" << std::endl;
+			std::exit(1);
+		}
+		cameras[0]->SetDistortion(lens);
+	}
+#endif
 
-		// let's assume that the i-th image overlaps with the (i-1)-th image for sure.
-		for (int i = 1; i < nImages; ++i) {
+	// the initial guesses place the cameras well enough to tell which images overlap.
+	OverlapGraph overlapGraph;
+	for (int i = 1; i < nImages; ++i) {
+		cameras[i].reset(new PPC{ *cameras[i - 1] });
+		cameras[i]->PanTiltRoll(cParams[i][0], cParams[i][1], cParams[i][2]);
+	}
+	buildOverlapGraph(cameras, overlapGraph);
+
+	// Cameras are aligned in breadth-first order over the overlap graph, starting from image 0:
+	// every image is aligned against the already placed image it overlaps most, starting from
+	// its initial guess relative to that image. Images that overlap no other image keep their
+	// initial guess relative to the previous one.
+	// The gains are only fitted once the cameras are placed, so alignment compares the unscaled images.
+	{
+		std::vector<PPC> initialCameras;
+		for (int i = 0; i < nImages; ++i) initialCameras.push_back(*cameras[i]);
+
+		std::vector<bool> reached(nImages, false), placed(nImages, false);
+		std::vector<int> order{ 0 };
+		reached[0] = true;
+		for (size_t n = 0; n < order.size(); ++n) {
+			const int i = order[n];
+			if (i != 0) {
+				int ref = -1;
+				double refArea = 0.0;
+				for (int e : overlapGraph.adjacent[i]) {
+					const OverlapEdge &edge = overlapGraph.edges[e];
+					int j = edge.i == i ? edge.j : edge.i;
+					if (placed[j] && edge.area > refArea) {
+						ref = j;
+						refArea = edge.area;
+					}
+				}
+				float x[3];
+				initialCameras[i].RelativePanTiltRoll(initialCameras[ref], x[0], x[1], x[2]);
+#ifdef DO_PHASE_CORRELATION_INIT
+				PhaseCorrelationEstimate estimate = phaseCorrelationInit(cameras[ref].get(), images[ref], images[i], x);
+				std::cout << "image #" << i << ": phase correlation: shift = (" << estimate.shiftX << ", " << estimate.shiftY
+					<< "), peak = " << estimate.peak << ", error = " << estimate.error << " (guess: " << estimate.guessError << ")"
+					<< (estimate.accepted ? "" : ", keeping the guess") << std::endl;
+#endif
 #ifdef DO_OPTIMIZE
-			optimize(powellError, cParams[i], cameras[i - 1].get(), images[i - 1], images[i]);
+				optimize(powellError, x, cameras[ref].get(), images[ref], images[i]);
 #endif
-			std::cout << cParams[i][0] << "," << cParams[i][1] << ',' << cParams[i][2] << std::endl;
+				std::cout << x[0] << "," << x[1] << ',' << x[2] << std::endl;
+				cameras[i].reset(new PPC{ *cameras[ref] });
+				cameras[i]->PanTiltRoll(x[0], x[1], x[2]);
+				std::cout << "image #" << i << ": aligned against image #" << ref << ": after optimization: error = "
+					<< stitchingError(cameras[ref].get(), images[ref], cameras[i].get(), images[i]) << std::endl;
+			}
+			placed[i] = true;
+			for (int e : overlapGraph.adjacent[i]) {
+				const OverlapEdge &edge = overlapGraph.edges[e];
+				int j = edge.i == i ? edge.j : edge.i;
+				if (!reached[j]) {
+					reached[j] = true;
+					order.push_back(j);
+				}
+			}
+		}
+		for (int i = 1; i < nImages; ++i) {
+			if (reached[i]) continue;
+			std::cout << "image #" << i << " overlaps no image connected to image #0, keeping its initial placement" << std::endl;
 			cameras[i].reset(new PPC{ *cameras[i - 1] });
-			cameras[i]->Pan(cParams[i][0]);
-			cameras[i]->Tilt(cParams[i][1]);
-			cameras[i]->Roll(cParams[i][2]);
-			std::cout << "image #" << i << ": after optimization: error = " << stitchingError(cameras[i - 1].get(), images[i - 1], cameras[i].get(), images[i]) << std::endl;
+			cameras[i]->PanTiltRoll(cParams[i][0], cParams[i][1], cParams[i][2]);
 		}
-
-		paintCamera = std::make_unique<PPC>(CUBEMAP_SIZE, CUBEMAP_SIZE, 90.0f);
-		{
-			Vector3f x0 = cameras[0]->a, y0 = -cameras[0]->b, z0 = -cameras[0]->GetVD();
-			x0.normalize(); y0.normalize(); z0.normalize();
-			Vector3f xn = cameras.back()->a, yn = -cameras.back()->b, zn = -cameras.back()->GetVD();
-			xn.normalize(); yn.normalize(); zn.normalize();
-			Quaternion q0; q0.fromRotMatrix(Matrix3f{ x0, y0, z0 });
-			Quaternion qn; qn.fromRotMatrix(Matrix3f{ xn, yn, zn });
-			Quaternion qm = Quaternion::slerp(q0, qn, 0.5);
-			Matrix3f mm = qm.toRotMatrix();
-			viewCamera->PositionAndOrient(viewCamera->C, viewCamera->C - mm.columns[2], mm.columns[1]);
-			paintCamera->PositionAndOrient(paintCamera->C, paintCamera->C - mm.columns[2], mm.columns[1]);
+		// the camera editor moves every camera relative to the previous one.
+		for (int i = 1; i < nImages; ++i) {
+			cameras[i]->RelativePanTiltRoll(*cameras[i - 1], cParams[i][0], cParams[i][1], cParams[i][2]);
 		}
-		// <<<<<<<<<<<<<<<<<<<<<<<<< Find relative camera locations <<<<<<<<<<<<<<<<<<<<<<<<
-
+	}
 
-		// >>>>>>>>>>>>>>>>>>>>>> Compute number of overlapping pixels >>>>>>>>>>>>>>>>>>>>>
+	paintCamera = std::make_unique<PPC>(CUBEMAP_SIZE, CUBEMAP_SIZE, 90.0f);
+	// orientation of the cube map: the front face looks halfway between the first and the last camera.
+	Matrix3f cubeOrientation;
+	{
+		Vector3f x0 = cameras[0]->a, y0 = -cameras[0]->b, z0 = -cameras[0]->GetVD();
+		x0.normalize(); y0.normalize(); z0.normalize();
+		Vector3f xn = cameras.back()->a, yn = -cameras.back()->b, zn = -cameras.back()->GetVD();
+		xn.normalize(); yn.normalize(); zn.normalize();
+		Quaternion q0; q0.fromRotMatrix(Matrix3f{ x0, y0, z0 });
+		Quaternion qn; qn.fromRotMatrix(Matrix3f{ xn, yn, zn });
+		Quaternion qm = Quaternion::slerp(q0, qn, 0.5);
+		Matrix3f mm = qm.toRotMatrix();
+		cubeOrientation = mm;
+		viewCamera->PositionAndOrient(viewCamera->C, viewCamera->C - mm.columns[2], mm.columns[1]);
+		paintCamera->PositionAndOrient(paintCamera->C, paintCamera->C - mm.columns[2], mm.columns[1]);
+	}
+	// <<<<<<<<<<<<<<<<<<<<<<<<< Find relative camera locations <<<<<<<<<<<<<<<<<<<<<<<<
 
-		// NOverlapPixels[i][j] denotes how many pixels overlapped for image _i_ and _j_.
-		int NOverlapPixels[nImages][nImages] = { 0 };
 
-		// I[i][j] denotes the average pixel intensity for image _i_, over the region overlapping with image _j_.
-		cv::Vec3f AverageI[nImages][nImages];
+	// >>>>>>>>>>>>>>>>>>>>>> Compute number of overlapping pixels >>>>>>>>>>>>>>>>>>>>>
 
-		const cv::Vec3f L(0.0722, 0.7152, 0.2126);
+	// the edges of the graph are the overlapping pairs at the aligned positions.
+	// edge.nIJ denotes how many pixels of image _i_ overlap image _j_, and
+	// edge.averageIJ the average pixel intensity of image _i_ over that region.
+	buildOverlapGraph(cameras, overlapGraph);
+	computeOverlapStats(cameras, images, overlapGraph);
 
-		for (int i = 0; i < nImages; ++i) {
-			for (int j = 0; j < nImages; ++j) if (j != i) {
-				std::tie(NOverlapPixels[i][j], AverageI[i][j]) =
-					ComputeImageOverlap(cameras[i].get(), images[i], cameras[j].get(), images[j].size());
-				float luminance = AverageI[i][j].dot(L);
-			}
-		}
+	const cv::Vec3f L(0.0722, 0.7152, 0.2126);
 
-		std::cout << "\n";
-		for (int i = 0; i < nImages; ++i) {
-			for (int j = 0; j < nImages; ++j) {
-				float luminance = AverageI[i][j].dot(L);
-				printf("%d - %5.2f, ", NOverlapPixels[i][j], luminance);
-			}
-			std::cout << '\n';
-		}
+	std::cout << "\n";
+	for (const OverlapEdge &edge : overlapGraph.edges) {
+		printf("%d - %d: %d - %5.2f, %d - %5.2f\n", edge.i, edge.j,
+			edge.nIJ, edge.averageIJ.dot(L), edge.nJI, edge.averageJI.dot(L));
+	}
 
-		// adjust the image brightness.
-		// comparing images between pairs i-1 and i.
-		// if AverageI(im_{i-1}, im_{i}) = p and AverageI(im_{i}, im_{i-1}) = q, 
-		// then that means the ratio of luminance of im1 to im0 is q/p.
-		// the luminance of im_i should be scaled by p/q.
+	// adjust the image brightness.
+	// one least-squares solve over every overlapping pair balances all images at once,
+	// instead of chaining the ratios from image to image (which lets the errors accumulate).
+	// the averages are taken over the unscaled images, so the gains do not depend on the previous ones.
 
-		std::cout << "\n";
-		//const int REF_I = 0;
-		
-		imGains[0] = 1.0f;
-		for (int i = 1; i < nImages; ++i) {
-			float p = AverageI[i - 1][i].dot(L);
-			float q = AverageI[i][i - 1].dot(L);
-			imGains[i] = imGains[i - 1] * (p / q);
-			printf("Image %d has luminance %f, image %d has luminance %f\n", i - 1, p, i, q);
-			printf("Image %d, '%s', is adjusted by a factor of %f.\n", i, filenames[i], imGains[i]);
-			images[i] *= imGains[i];
-		}
+	// with vignetting correction, the gains are fitted together with a radial falloff per camera
+	// from correspondences sampled in the overlaps, instead of one average per overlap.
 
-		// <<<<<<<<<<<<<<<<<<<<<< Compute number of overlapping pixels <<<<<<<<<<<<<<<<<<<<<
+	std::cout << "\n";
+#ifdef DO_VIGNETTING_CORRECTION
+	exposures = fitExposure(cameras, images, overlapGraph);
+#else
+	std::vector<cv::Vec3f> gains = solveGains(nImages, overlapGraph);
+	for (int i = 0; i < nImages; ++i) {
+		exposures[i] = ExposureModel(gains[i]);
+	}
+#endif
+	for (int i = 0; i < nImages; ++i) {
+		const ExposureModel &exposure = exposures[i];
+		printf("Image %d, '%s', is adjusted by a factor of (%f, %f, %f), vignetting (%f, %f, %f).\n", i, filenames[i],
+			exposure.gain[0], exposure.gain[1], exposure.gain[2], exposure.vignetting[0], exposure.vignetting[1], exposure.vignetting[2]);
 	}
 
+	// <<<<<<<<<<<<<<<<<<<<<< Compute number of overlapping pixels <<<<<<<<<<<<<<<<<<<<<
+
 	// what's the error now?
-	for (int i = 1; i < nImages; ++i) {
-		std::cout << "image #" << i << ": after optimization: error = " << stitchingError(cameras[i-1].get(), images[i-1], cameras[i].get(), images[i]) << std::endl;
+	for (const OverlapEdge &edge : overlapGraph.edges) {
+		int i = edge.i, j = edge.j;
+		std::cout << "images #" << i << " - #" << j << ": after optimization: error = "
+			<< stitchingError(cameras[i].get(), images[i], cameras[j].get(), images[j], exposures[i].gain, exposures[j].gain) << std::endl;
 	}
 
 	// Generate cube map
+	CompositeOptions compositeOptions;
+	compositeOptions.filter = RESAMPLE_BICUBIC;
+	compositeOptions.mipmaps = true;
+#ifdef DO_MULTIBAND_BLENDING
+	compositeOptions.blend = BLEND_MULTIBAND;
+#endif
+#ifdef DO_SEAM_FINDING
+	compositeOptions.findSeams = true;
+#endif
+	CubemapCompositor cubemapCompositor(*paintCamera, cameras, images, false);
+	cubemapCompositor.composite(images, exposures, cubeIms, compositeOptions);
+
+	std::string stitchedImageFN = prefix;
+	if (stitchedImageFN.back() != '/') stitchedImageFN += '/';
+	cv::imwrite(stitchedImageFN + "stitched.png", cubeIms[CUBE_FRONT]);
+
+#ifdef DO_TILED_EXPORT
+	// Renders the cube map at EXPORT_CUBEMAP_SIZE into out-of-core faces backed by scratch files
+	// and writes every face out tile row by tile row, so no face is ever held in memory as a whole:
+	// the output size is limited by disk space rather than RAM. Tiled faces only support feather blending.
 	{
-		for (int i = 0; i < nImages; ++i) {
-			drawImageOnCanvas(paintCamera.get(), midCubeIm, cameras[i].get(), images[i], imGains[i]);
-		}
-		paintCamera->Pan(-90.0f);
-		for (int i = 0; i < nImages; ++i) {
-			drawImageOnCanvas(paintCamera.get(), leftCubeIm, cameras[i].get(), images[i], imGains[i]);
+		PPC exportCamera{ EXPORT_CUBEMAP_SIZE, EXPORT_CUBEMAP_SIZE, 90.0f };
+		exportCamera.PositionAndOrient(exportCamera.C, exportCamera.C - cubeOrientation.columns[2], cubeOrientation.columns[1]);
+		CompositeOptions exportOptions = compositeOptions;
+		exportOptions.blend = BLEND_FEATHER;
+		exportOptions.findSeams = false;
+
+		const char * faceNames[CUBE_FACES] = { "front", "left", "right", "back", "top", "bottom" };
+		std::unique_ptr<TiledCanvas> exportFaces[CUBE_FACES];
+		TiledCanvas * exportFacePtrs[CUBE_FACES];
+		for (int f = 0; f < CUBE_FACES; ++f) {
+			exportFaces[f].reset(new TiledCanvas(cv::Size(EXPORT_CUBEMAP_SIZE, EXPORT_CUBEMAP_SIZE),
+				stitchedImageFN + faceNames[f] + ".scratch"));
+			exportFacePtrs[f] = exportFaces[f].get();
 		}
-		paintCamera->Pan(180.0f);
-		for (int i = 0; i < nImages; ++i) {
-			drawImageOnCanvas(paintCamera.get(), rightCubeIm, cameras[i].get(), images[i], imGains[i]);
+		CubemapCompositor(exportCamera, cameras, images, false).composite(images, exposures, exportFacePtrs, exportOptions);
+
+		for (int f = 0; f < CUBE_FACES; ++f) {
+			std::string faceFN = stitchedImageFN + "cube_" + faceNames[f] + ".ppm";
+			if (!exportFaces[f]->writePPM(faceFN)) {
+				std::cerr << "cannot write the cube map face '" << faceFN << "'" << std::endl;
+				std::exit(1);
+			}
+			std::cout << "wrote " << faceFN << std::endl;
 		}
 	}
-	std::string stitchedImageFN = prefix;
-	if (stitchedImageFN.back() != '/') stitchedImageFN += '/';
-	cv::imwrite(stitchedImageFN + "stitched.png", midCubeIm);
+#endif
 	
 	// compute brightest pixel
 	//{
 	//	std::vector < cv::Mat> channels;
-	//	cv::split(midCubeIm, channels);
+	//	cv::split(cubeIms[CUBE_FRONT], channels);
 	//	double max = 0.0f; double min = 1.0f;
 	//	for (int i = 0; i < channels.size(); ++i) {
 	//		cv::minMaxLoc(channels[0], &min, &max);
@@ -372,12 +471,20 @@ int main() {
 	//	}
 	//}
 
-	glGenTextures(1, &midCubeTex);
-	glGenTextures(1, &leftCubeTex);
-	glGenTextures(1, &rightCubeTex);
-	sendCVMatToGLTex(midCubeIm, midCubeTex);
-	sendCVMatToGLTex(leftCubeIm, leftCubeTex);
-	sendCVMatToGLTex(rightCubeIm, rightCubeTex);
+	glGenTextures(CUBE_FACES, cubeTexs);
+	for (int f = 0; f < CUBE_FACES; ++f) {
+		sendCVMatToGLTex(cubeIms[f], cubeTexs[f]);
+	}
+
+	// the rectangle is the front face, other faces are rotated around the origin.
+	const glm::mat4 faceModelTrans[CUBE_FACES] = {
+		glm::mat4(),
+		glm::rotate(glm::radians(90.0f), glm::vec3(0.0, 1.0, 0.0)),		// left
+		glm::rotate(glm::radians(-90.0f), glm::vec3(0.0, 1.0, 0.0)),	// right
+		glm::rotate(glm::radians(180.0f), glm::vec3(0.0, 1.0, 0.0)),	// back
+		glm::rotate(glm::radians(90.0f), glm::vec3(1.0, 0.0, 0.0)),		// top
+		glm::rotate(glm::radians(-90.0f), glm::vec3(1.0, 0.0, 0.0))		// bottom
+	};
 
 
 	while (!glfwWindowShouldClose(window)) {
@@ -395,8 +502,8 @@ int main() {
 			ImGui::TextWrapped("Click and drag the mouse to move the view direction.");
 			//ImGui::TextWrapped("Right-click the mouse to look at origin.");
 			if (ImGui::Button("Calculate error")) {
-				imv::errorTR = stitchingError(cameras[0].get(), images[0], cameras[1].get(), images[1]);
-				imv::errorBR = stitchingError(cameras[1].get(), images[1], cameras[2].get(), images[2]);
+				imv::errorTR = stitchingError(cameras[0].get(), images[0], cameras[1].get(), images[1], exposures[0].gain, exposures[1].gain);
+				imv::errorBR = stitchingError(cameras[1].get(), images[1], cameras[2].get(), images[2], exposures[1].gain, exposures[2].gain);
 				imv::errorTR = std::sqrt(imv::errorTR);
 				imv::errorBR = std::sqrt(imv::errorBR);
 			}
@@ -410,6 +517,42 @@ int main() {
 			else {
 				ImGui::Text("HDR max = %.3f", imv::HDRmax);
 			}
+			// nudging a camera only re-renders the tiles its chain covered before or covers now.
+			// Multi-band and seam blending reach across whole faces, so while the camera is dragged
+			// those tiles are feather blended, and the changed faces are blended in full on release.
+			if (nImages > 1) {
+				ImGui::SliderInt("Camera", &imv::editedCamera, 1, int(nImages) - 1);
+				const int i = imv::editedCamera;
+				const bool edited = ImGui::DragFloat3("Pan, tilt, roll", cParams[i], 0.05f);
+				const bool dragging = ImGui::IsItemActive();
+				const bool fullBlend = compositeOptions.blend != BLEND_FEATHER || compositeOptions.findSeams;
+				if (edited) {
+					// cParams[k] is relative to camera k - 1, so the cameras after _i_ move with it
+					// and keep their parameters.
+					for (int k = i; k < int(nImages); ++k) {
+						cameras[k].reset(new PPC{ *cameras[k - 1] });
+						cameras[k]->PanTiltRoll(cParams[k][0], cParams[k][1], cParams[k][2]);
+						cubemapCompositor.updateCamera(k, *cameras[k], images);
+					}
+					CompositeOptions dragOptions = compositeOptions;
+					dragOptions.blend = BLEND_FEATHER;
+					dragOptions.findSeams = false;
+					bool changedFaces[CUBE_FACES];
+					cubemapCompositor.recomposite(images, exposures, cubeIms, dragOptions, changedFaces);
+					for (int f = 0; f < CUBE_FACES; ++f) {
+						if (!changedFaces[f]) continue;
+						sendCVMatToGLTex(cubeIms[f], cubeTexs[f]);
+						if (fullBlend) imv::facesToReblend[f] = true;
+					}
+				}
+				if (!dragging && std::find(imv::facesToReblend, imv::facesToReblend + CUBE_FACES, true) != imv::facesToReblend + CUBE_FACES) {
+					cubemapCompositor.compositeFaces(images, exposures, cubeIms, compositeOptions, imv::facesToReblend);
+					for (int f = 0; f < CUBE_FACES; ++f) {
+						if (imv::facesToReblend[f]) sendCVMatToGLTex(cubeIms[f], cubeTexs[f]);
+						imv::facesToReblend[f] = false;
+					}
+				}
+			}
 			ImGui::End();
 		}
 		projTrans = viewCamera->GetProjectionTrans(0.1f, 100.0f);
@@ -424,19 +567,11 @@ int main() {
 		program.uniform1f("HDRmax", imv::HDRmax);
 
 		glBindVertexArray(rectVAO);
-		glBindTexture(GL_TEXTURE_2D, midCubeTex);
-		glDrawArrays(GL_TRIANGLES, 0, 6);
-
-		// left side
-		modelTrans = glm::rotate(glm::radians(90.0f), glm::vec3(0.0, 1.0, 0.0));
-		program.uniformMat4("model", modelTrans);
-		glBindTexture(GL_TEXTURE_2D, leftCubeTex);
-		glDrawArrays(GL_TRIANGLES, 0, 6);
-
-		modelTrans = glm::rotate(glm::radians(-90.0f), glm::vec3(0.0, 1.0, 0.0));
-		program.uniformMat4("model", modelTrans);
-		glBindTexture(GL_TEXTURE_2D, rightCubeTex);
-		glDrawArrays(GL_TRIANGLES, 0, 6);
+		for (int f = 0; f < CUBE_FACES; ++f) {
+			program.uniformMat4("model", faceModelTrans[f]);
+			glBindTexture(GL_TEXTURE_2D, cubeTexs[f]);
+			glDrawArrays(GL_TRIANGLES, 0, 6);
+		}
 
 		if (imv::shouldAdjustHDRRange && imv::manualHDR == false) {
 			imv::shouldAdjustHDRRange = false;
@@ -522,6 +657,7 @@ void mouseScroll_callback(GLFWwindow * window, double xOffset, double yOffset) {
 	if (ImGui::GetIO().WantCaptureMouse == false) {
 		//viewCamera->Translate(viewCamera->GetVD() * yOffset * 2.0);
 		viewCamera->c += viewCamera->GetVD() * yOffset * 10.0;
+		viewCamera->UpdateDerived();
 		imv::shouldAdjustHDRRange = true;
 	}
 	ImGui_ImplGlfwGL3_ScrollCallback(window, xOffset, yOffset);
@@ -536,44 +672,6 @@ void testMath() {
 	return;
 }
 
-void drawImageOnCanvas(const PPC * viewPPC, cv::Mat & canvas, const PPC * objPPC, cv::Mat & objImage, float imGain) {
-	Matrix3f Mview{ viewPPC->a, viewPPC->b, viewPPC->c };
-	Matrix3f MObj{ objPPC->a, objPPC->b, objPPC->c };
-
-	assert(objImage.channels() == 3);
-	assert(objImage.depth() == CV_32F);
-
-	// MObj * uvobj*w = Mview*uvview
-	Matrix3f M = MObj.inverted()*Mview;
-	for (int u = 0; u < canvas.cols; ++u) {
-		for (int v = 0; v < canvas.rows; ++v) {
-			Vector3f uvView{ u + 0.5f, v + 0.5f, 1.0f };
-			Vector3f uvObj = M * uvView;
-			if (uvObj.z < 0)
-				continue;
-			uvObj /= uvObj.z;
-			if (uvObj.x < 0 || uvObj.x > objImage.cols - 1 || uvObj.y < 0 || uvObj.y > objImage.rows - 1)
-				continue;
-
-			cv::Vec3f objColor;
-			objColor = objImage.at<cv::Vec3f>(uvObj.y, uvObj.x);// * imGain;
-
-			cv::Vec3f canvasColor = canvas.at<cv::Vec3f>(v, u);
-			if (canvasColor == BGCOLOR) {
-				canvas.at<cv::Vec3f>(v, u) = objColor;
-			}
-			else {
-				// for uvObj, how far is it from the center to the current pixel?
-				float d = std::abs(uvObj.x - objImage.cols / 2) / (objImage.cols/2);
-				// for now d is in [0, 1]. 0 means at the center, 1 means at the border.
-				// d would be the weight for the existing color.
-				cv::Vec3f blendedColor = canvasColor*d + objColor*(1-d);
-				canvas.at<cv::Vec3f>(v, u) = blendedColor;
-			}
-		}
-	}
-}
-
 void setupVAO() {
 	float vertices[] = {
 		-10.0,  10.0, -10.0,	0.0, 1.0,
@@ -599,46 +697,6 @@ void setupVAO() {
 }
 
 
-std::pair<int, cv::Vec3f> ComputeImageOverlap(const PPC *ppc0, const cv::Mat &im0, const PPC *ppc1, cv::Size size1)
-{
-	// Compute the number of pixels in im0 that is overlapping im1.
-	// Compute the average color of those pixels.
-	assert(im0.channels() == 3);
-	assert(im0.depth() == CV_32F);
-
-	Matrix3f M0{ ppc0->a, ppc0->b, ppc0->c };
-	Matrix3f M1{ ppc1->a, ppc1->b, ppc1->c };
-	// M0*uv0 = M1*uv1
-	// uv1 = M1^{-1}*M0.
-	Matrix3f M = M1.inverted()*M0;
-
-	int pCount = 0;
-
-	// for every pixel in image0, uv0
-	//   find its coordinate, uv1 in im1
-	//   if uv1 is in boundary
-	//     increment the count
-	//     tally up the pixel color
-
-	pCount = 0;
-	cv::Vec3f sum(0.0, 0.0f, 0.0);
-
-	for (int r = 0; r < im0.rows; ++r) {
-		for (int c = 0; c < im0.cols; ++c) {
-			Vector3f uv0{ float(c) + 0.5f, float(r) + 0.5f, 1.0f };
-			Vector3f uv1 = M*uv0;
-			uv1 /= uv1.z;
-			if (uv1.x >= 0 && uv1.x < size1.width && uv1.y >= 0 && uv1.y < size1.height) {
-				pCount++;
-				cv::Vec3f color = im0.at<cv::Vec3f>(r, c);
-				sum += color;
-			}
-		}
-	}
-
-	return std::make_pair(pCount, sum / pCount);
-}
-
 bool sendCVMatToGLTex(cv::Mat mat, GLuint tex, bool normalize) {
 	// TODO: we need to flip the image before sending the data to the texture.
 	// Image in OpenCV starts at the top (matrix indexing) but image in OpenGL starts at the bottom (deCartesian coordinate).
@@ -1,9 +1,14 @@
 #include "optimize.h"
 #include "powell/powell.h"
+#include <opencv2/imgproc.hpp>
 #include <omp.h>
 #include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <vector>
 const PPC * refCamera = nullptr;
 cv::Mat refImage, objImage;
+cv::Vec3f refGain(1.0f, 1.0f, 1.0f), objGain(1.0f, 1.0f, 1.0f);
 
 float errorFunction(float powell_params[3], bool debug) {
 	static int count = 0;
@@ -13,21 +18,21 @@ float errorFunction(float powell_params[3], bool debug) {
 	// params[2]: roll
 
 	PPC testCamera = *refCamera;
-	testCamera.Pan(powell_params[0]);
-	testCamera.Tilt(powell_params[1]);
-	testCamera.Roll(powell_params[2]);
+	testCamera.PanTiltRoll(powell_params[0], powell_params[1], powell_params[2]);
 
-	return stitchingError(refCamera, refImage, &testCamera, objImage);
+	return stitchingError(refCamera, refImage, &testCamera, objImage, refGain, objGain);
 }
 
 float powellError(float *powell_params) {
 	return errorFunction(powell_params + 1);
 }
 
-float stitchingError(const PPC * refPPC, cv::Mat & refIm, const PPC * objPPC, cv::Mat & objIm) {
-	Matrix3f MRef{ refPPC->a, refPPC->b, refPPC->c };
-	Matrix3f MObj{ objPPC->a, objPPC->b, objPPC->c };
-	Matrix3f M = MRef.inverted()*MObj;
+float stitchingError(const PPC * refPPC, cv::Mat & refIm, const PPC * objPPC, cv::Mat & objIm,
+	const cv::Vec3f & refGain, const cv::Vec3f & objGain)
+{
+	Matrix3f M = refPPC->GetInverseBasis()*objPPC->GetBasis();
+	// both images are read through their lens maps; the pixels visited are those of the ideal object image.
+	const UndistortionMap *refLens = refPPC->GetUndistortionMap().get(), *objLens = objPPC->GetUndistortionMap().get();
 
 	static int count = 0;
 	count++;
@@ -47,36 +52,51 @@ float stitchingError(const PPC * refPPC, cv::Mat & refIm, const PPC * objPPC, cv
 	//     make 1 contribution to number of pixels counted
 	std::atomic_int pCount = 0;
 	std::atomic_int64_t sumDiffInt = 0;
-#pragma omp parallel for
-	for (int r = 0; r < objIm.rows; ++r) {
-		for (int c = 0; c < objIm.cols; ++c) {
-			Vector3f uv1{ float(c) + 0.5f, float(r) + 0.5f, 1.0f };
-			Vector3f uv0 = M * uv1;
-			uv0 /= uv0.z;
-			if (uv0.x < 0 || uv0.x > refIm.cols - 1 || uv0.y < 0 || uv0.y > refIm.rows - 1)
-				continue;
-
-			cv::Vec3f refColor = refIm.at<cv::Vec3f>(uv0.y, uv0.x);
-			if (false) {
-				cv::Point2i ulC(uv0.x, uv0.y), urC(uv0.x + 0.5, uv0.y);
-				cv::Point2i llC(uv0.x, uv0.y + 0.5), lrC(uv0.x + 0.5, uv0.y + 0.5);
-				cv::Vec3f ul = refIm.at<cv::Vec3f>(ulC);
-				cv::Vec3f ur = refIm.at<cv::Vec3f>(urC);
-				cv::Vec3f ll = refIm.at<cv::Vec3f>(llC);
-				cv::Vec3f lr = refIm.at<cv::Vec3f>(lrC);
-				float dx = uv0.x - ulC.x, dy = uv0.y - ulC.y;
-				cv::Vec3f u = ul * (1 - dx) + ur * dx;
-				cv::Vec3f l = ll * (1 - dx) + lr*dx;
-				refColor = u * (1 - dy) + l * dy;
+#pragma omp parallel
+	{
+		// positions of the current row of the object image in the reference image.
+		std::vector<float> rowX(objIm.cols), rowY(objIm.cols);
+		std::vector<std::uint32_t> rowValid((objIm.cols + 31) / 32);
+#pragma omp for
+		for (int r = 0; r < objIm.rows; ++r) {
+			M.projectRow(0.5f, float(r) + 0.5f, objIm.cols, rowX.data(), rowY.data(), rowValid.data());
+			if (refLens)
+				refLens->apply(rowX.data(), rowY.data(), rowValid.data(), objIm.cols);
+			for (int c = 0; c < objIm.cols; ++c) {
+				Vector3f uv0{ rowX[c], rowY[c], 1.0f };
+				if (!batchValid(rowValid.data(), c) || uv0.x < 0 || uv0.x > refIm.cols - 1 || uv0.y < 0 || uv0.y > refIm.rows - 1)
+					continue;
+				int objR = r, objC = c;
+				if (objLens) {
+					cv::Point2f p = (*objLens)(c + 0.5f, r + 0.5f);
+					if (p.x < 0 || p.x >= objIm.cols || p.y < 0 || p.y >= objIm.rows)
+						continue;
+					objR = int(p.y); objC = int(p.x);
+				}
+
+				cv::Vec3f refColor = refIm.at<cv::Vec3f>(uv0.y, uv0.x);
+				if (false) {
+					cv::Point2i ulC(uv0.x, uv0.y), urC(uv0.x + 0.5, uv0.y);
+					cv::Point2i llC(uv0.x, uv0.y + 0.5), lrC(uv0.x + 0.5, uv0.y + 0.5);
+					cv::Vec3f ul = refIm.at<cv::Vec3f>(ulC);
+					cv::Vec3f ur = refIm.at<cv::Vec3f>(urC);
+					cv::Vec3f ll = refIm.at<cv::Vec3f>(llC);
+					cv::Vec3f lr = refIm.at<cv::Vec3f>(lrC);
+					float dx = uv0.x - ulC.x, dy = uv0.y - ulC.y;
+					cv::Vec3f u = ul * (1 - dx) + ur * dx;
+					cv::Vec3f l = ll * (1 - dx) + lr*dx;
+					refColor = u * (1 - dy) + l * dy;
+				}
+				refColor = refColor.mul(refGain);
+				cv::Vec3f objColor = objIm.at<cv::Vec3f>(objR, objC).mul(objGain);
+				//Vector3f diffColor{ float(refColor[0]) - objColor[0], float(refColor[1]) - objColor[1], float(refColor[2]) - objColor[2] };
+				cv::Vec3f cDiff = objColor - refColor;
+				float squareDiff = cDiff.dot(cDiff);
+				int squareDiffInt = squareDiff * 65535;
+
+				pCount++;
+				sumDiffInt += squareDiffInt;
 			}
-			cv::Vec3f objColor = objIm.at<cv::Vec3f>(r, c);
-			//Vector3f diffColor{ float(refColor[0]) - objColor[0], float(refColor[1]) - objColor[1], float(refColor[2]) - objColor[2] };
-			cv::Vec3f cDiff = objColor - refColor;
-			float squareDiff = cDiff.dot(cDiff);
-			int squareDiffInt = squareDiff * 65535;
-
-			pCount++;
-			sumDiffInt += squareDiffInt;
 		}
 	}
 	assert(sumDiffInt >= 0);
@@ -87,13 +107,16 @@ float stitchingError(const PPC * refPPC, cv::Mat & refIm, const PPC * objPPC, cv
 	return float(sumDiff) / pCount;
 }
 
-float optimize(float(*energy)(float[3]), float x[3], const PPC *refPPC, const cv::Mat &refIm, const cv::Mat &objIm) {
-
+float optimize(float(*energy)(float[3]), float x[3], const PPC *refPPC, const cv::Mat &refIm, const cv::Mat &objIm,
+	const cv::Vec3f &refG, const cv::Vec3f &objG)
+{
 	// setup the cameras and image references
 	if (refPPC == nullptr) return -1.0f;
 	refCamera = refPPC;
 	refImage = refIm;
 	objImage = objIm;
+	refGain = refG;
+	objGain = objG;
 
 	// prepare workspace for powell.
 	int n = 3;
@@ -126,4 +149,111 @@ float optimize(float(*energy)(float[3]), float x[3], const PPC *refPPC, const cv
 	delete[] xi;
 	delete[] p;
 	return fret;
-}
\ No newline at end of file
+}
+
+// >>>>>>>>>>>>>>>>>>>>>>>>>>>> Phase correlation >>>>>>>>>>>>>>>>>>>>>>>>>>>>
+
+// Downscales _im_ to fit in size*size, converts it to zero-mean grayscale,
+// applies a Hanning window and zero-pads it into a dftRows*dftCols canvas.
+static cv::Mat phaseCorrelationInput(const cv::Mat &im, float scale, int dftRows, int dftCols) {
+	cv::Mat small, gray;
+	cv::resize(im, small, cv::Size(), scale, scale, cv::INTER_AREA);
+	cv::cvtColor(small, gray, cv::COLOR_BGR2GRAY);
+
+	cv::Mat window;
+	cv::createHanningWindow(window, gray.size(), CV_32F);
+	float mean = float(cv::sum(gray)[0] / gray.total());
+
+	cv::Mat padded = cv::Mat::zeros(dftRows, dftCols, CV_32F);
+	for (int r = 0; r < gray.rows; ++r) {
+		const float *g = gray.ptr<float>(r);
+		const float *w = window.ptr<float>(r);
+		float *p = padded.ptr<float>(r);
+		for (int c = 0; c < gray.cols; ++c) {
+			p[c] = (g[c] - mean) * w[c];
+		}
+	}
+	return padded;
+}
+
+PhaseCorrelationEstimate phaseCorrelationInit(const PPC *refPPC, const cv::Mat &refIm, const cv::Mat &objIm, float x[3], int size) {
+	PhaseCorrelationEstimate result;
+	if (refPPC == nullptr) return result;
+	assert(refIm.size() == objIm.size());
+
+	float scale = float(size) / std::max(refIm.cols, refIm.rows);
+	int rows = int(refIm.rows * scale + 0.5f), cols = int(refIm.cols * scale + 0.5f);
+
+	// Neighbouring images can be shifted by about half of the image width, so the inputs are
+	// zero-padded to twice their size to keep the circular correlation from wrapping around.
+	int dftRows = cv::getOptimalDFTSize(rows * 2), dftCols = cv::getOptimalDFTSize(cols * 2);
+	cv::Mat refF, objF;
+	cv::dft(phaseCorrelationInput(refIm, scale, dftRows, dftCols), refF, cv::DFT_COMPLEX_OUTPUT);
+	cv::dft(phaseCorrelationInput(objIm, scale, dftRows, dftCols), objF, cv::DFT_COMPLEX_OUTPUT);
+
+	// normalized cross-power spectrum: if obj(x) = ref(x - t), R = exp(-i*w*t) and
+	// its inverse transform peaks at +t.
+	cv::Mat R;
+	cv::mulSpectrums(objF, refF, R, 0, true);
+	for (int r = 0; r < R.rows; ++r) {
+		cv::Vec2f *p = R.ptr<cv::Vec2f>(r);
+		for (int c = 0; c < R.cols; ++c) {
+			float mag = std::sqrt(p[c][0] * p[c][0] + p[c][1] * p[c][1]);
+			p[c] *= 1.0f / (mag + 1e-6f);
+		}
+	}
+	cv::Mat corrComplex;
+	cv::idft(R, corrComplex, cv::DFT_SCALE);
+	std::vector<cv::Mat> corrChannels;
+	cv::split(corrComplex, corrChannels);
+	const cv::Mat &corr = corrChannels[0];
+
+	cv::Point peak;
+	double peakValue;
+	cv::minMaxLoc(corr, nullptr, &peakValue, nullptr, &peak);
+
+	// sub-pixel refinement by fitting a parabola through the peak and its neighbours.
+	auto wrapped = [&](int r, int c) {
+		return corr.at<float>((r + corr.rows) % corr.rows, (c + corr.cols) % corr.cols);
+	};
+	auto parabolaOffset = [](float l, float m, float r) {
+		float denom = l - 2.0f * m + r;
+		return std::abs(denom) < 1e-6f ? 0.0f : 0.5f * (l - r) / denom;
+	};
+	float tx = peak.x + parabolaOffset(wrapped(peak.y, peak.x - 1), float(peakValue), wrapped(peak.y, peak.x + 1));
+	float ty = peak.y + parabolaOffset(wrapped(peak.y - 1, peak.x), float(peakValue), wrapped(peak.y + 1, peak.x));
+	if (tx > dftCols / 2) tx -= dftCols;
+	if (ty > dftRows / 2) ty -= dftRows;
+	tx /= scale;
+	ty /= scale;
+
+	// Panning right by theta moves the content of the reference image left by f*tan(theta) pixels,
+	// and tilting down by theta moves it up by f*tan(theta).
+	float f = refPPC->GetF();
+	float estimate[3] = {
+		-std::atan(tx / f) * 180.0f / 3.14159265358979f,
+		-std::atan(ty / f) * 180.0f / 3.14159265358979f,
+		x[2]
+	};
+
+	// only keep the estimate if it is actually better than the given guess.
+	cv::Mat refImCopy = refIm, objImCopy = objIm;
+	auto errorAt = [&](const float params[3]) {
+		PPC testCamera = *refPPC;
+		testCamera.PanTiltRoll(params[0], params[1], params[2]);
+		return stitchingError(refPPC, refImCopy, &testCamera, objImCopy);
+	};
+	result.shiftX = tx;
+	result.shiftY = ty;
+	result.peak = float(peakValue);
+	result.guessError = errorAt(x);
+	result.error = errorAt(estimate);
+	result.accepted = result.error < result.guessError || (std::isnan(result.guessError) && !std::isnan(result.error));
+	if (result.accepted) {
+		x[0] = estimate[0];
+		x[1] = estimate[1];
+	}
+	return result;
+}
+
+// <<<<<<<<<<<<<<<<<<<<<<<<<<<< Phase correlation <<<<<<<<<<<<<<<<<<<<<<<<<<<<
@@ -6,6 +6,24 @@
 
 float errorFunction(float params[3], bool debug = false);
 float powellError(float *p);
-float stitchingError(const PPC * refPPC, cv::Mat &refIm, const PPC * objPPC, cv::Mat &objIm);
-float optimize(float(*energy)(float[3]), float x[3], const PPC *refPPC, const cv::Mat &refImage, const cv::Mat &objImage);
+// Mean squared color difference over the pixels of _objIm_ that fall inside _refIm_.
+// Both images are scaled by their per-channel gains while they are sampled.
+float stitchingError(const PPC * refPPC, cv::Mat &refIm, const PPC * objPPC, cv::Mat &objIm,
+	const cv::Vec3f &refGain = cv::Vec3f(1.0f, 1.0f, 1.0f), const cv::Vec3f &objGain = cv::Vec3f(1.0f, 1.0f, 1.0f));
+float optimize(float(*energy)(float[3]), float x[3], const PPC *refPPC, const cv::Mat &refImage, const cv::Mat &objImage,
+	const cv::Vec3f &refGain = cv::Vec3f(1.0f, 1.0f, 1.0f), const cv::Vec3f &objGain = cv::Vec3f(1.0f, 1.0f, 1.0f));
+
+// What phaseCorrelationInit found, for the caller to report.
+struct PhaseCorrelationEstimate {
+	float shiftX = 0.0f, shiftY = 0.0f;	// shift of _objImage_ against _refImage_, in pixels of the images
+	float peak = 0.0f;					// height of the correlation peak, 1 for a pure shift
+	float error = 0.0f;					// stitching error at the estimate
+	float guessError = 0.0f;			// stitching error at the given guess
+	bool accepted = false;				// whether the estimate replaced the guess
+};
+
+// Estimates pan and tilt of _objImage_ relative to _refImage_ by FFT phase correlation
+// over downscaled grayscale copies, and writes them into x[0] and x[1] (roll is kept).
+// The estimate only replaces _x_ if it has a lower stitching error than the given guess.
+PhaseCorrelationEstimate phaseCorrelationInit(const PPC *refPPC, const cv::Mat &refImage, const cv::Mat &objImage, float x[3], int size = 256);
 
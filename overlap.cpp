@@ -0,0 +1,275 @@
+#include "overlap.h"
+#include <omp.h>
+#include <algorithm>
+#include <cmath>
+
+static const float PI = 3.14159265358979f;
+
+// Finds the columns [c0, c1) of row _r_ of an image with _cols_ columns whose pixel centers
+// M maps inside an image of _size_, in front of its camera. Returns false if there are none.
+// With z > 0 every bound of the image is a linear inequality in the column, and so is z > 0
+// itself, so the columns inside always form one span that can be solved for directly.
+static bool insideSpan(const Matrix3f &M, int r, int cols, cv::Size size, int &c0, int &c1) {
+	const Vector3f base = M * Vector3f{ 0.5f, r + 0.5f, 1.0f };
+	const Vector3f &d = M.col(0);
+	double lo = 0.0, hi = double(cols);
+
+	// keeps the columns c with a + b*c >= 0.
+	auto clip = [&](double a, double b) {
+		if (b > 0.0) lo = std::max(lo, std::ceil(-a / b));
+		else if (b < 0.0) hi = std::min(hi, std::floor(-a / b) + 1.0);
+		else if (a < 0.0) hi = lo;
+	};
+	clip(base.z, d.z);													// z > 0
+	clip(base.x, d.x);													// x >= 0
+	clip(size.width * base.z - base.x, double(size.width) * d.z - d.x);		// x < width
+	clip(base.y, d.y);													// y >= 0
+	clip(size.height * base.z - base.y, double(size.height) * d.z - d.y);	// y < height
+
+	if (lo >= hi) return false;
+	c0 = int(lo);
+	c1 = int(hi);
+	return true;
+}
+
+double overlapPolygon(const PPC * iPPC, cv::Size iSize, const PPC * jPPC, cv::Size jSize,
+	std::vector<cv::Point2d> & polygon)
+{
+	// maps homogeneous pixel coordinates of image _i_ to image _j_.
+	Matrix3f M = jPPC->GetInverseBasis()*iPPC->GetBasis();
+	const Vector3f &du = M.col(0), &dv = M.col(1), &o = M.col(2);
+
+	polygon = {
+		{ 0.0, 0.0 },
+		{ double(iSize.width), 0.0 },
+		{ double(iSize.width), double(iSize.height) },
+		{ 0.0, double(iSize.height) }
+	};
+
+	// keeps the part of the polygon where a*u + b*v + c >= 0 (Sutherland-Hodgman).
+	std::vector<cv::Point2d> clipped;
+	auto clip = [&](double a, double b, double c) {
+		clipped.clear();
+		for (size_t k = 0; k < polygon.size(); ++k) {
+			const cv::Point2d &p = polygon[k], &q = polygon[(k + 1) % polygon.size()];
+			double dp = a * p.x + b * p.y + c, dq = a * q.x + b * q.y + c;
+			if (dp >= 0.0)
+				clipped.push_back(p);
+			if ((dp >= 0.0) != (dq >= 0.0))
+				clipped.push_back(p + (q - p) * (dp / (dp - dq)));
+		}
+		polygon.swap(clipped);
+	};
+	// the same bounds as insideSpan, in both u and v.
+	const double W = jSize.width, H = jSize.height;
+	clip(du.z, dv.z, o.z);														// z > 0
+	clip(du.x, dv.x, o.x);														// x >= 0
+	clip(W * du.z - du.x, W * dv.z - dv.x, W * o.z - o.x);						// x < width
+	clip(du.y, dv.y, o.y);														// y >= 0
+	clip(H * du.z - du.y, H * dv.z - dv.y, H * o.z - o.y);						// y < height
+	if (polygon.size() < 3) {
+		polygon.clear();
+		return 0.0;
+	}
+
+	// shoelace formula.
+	double area = 0.0;
+	for (size_t k = 0; k < polygon.size(); ++k) {
+		const cv::Point2d &p = polygon[k], &q = polygon[(k + 1) % polygon.size()];
+		area += p.x * q.y - q.x * p.y;
+	}
+	return 0.5 * std::abs(area);
+}
+
+// >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> Overlap graph >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
+
+int OverlapGraph::edge(int i, int j) const {
+	if (i > j) std::swap(i, j);
+	for (int e : adjacent[i]) {
+		if (edges[e].i == i && edges[e].j == j) return e;
+	}
+	return -1;
+}
+
+// Cone around the rays of a camera: _axis_ is its central ray and every ray through its
+// frame is within _radius_ radians of it.
+struct ViewCone {
+	Vector3f axis;
+	float radius;
+	float latitude, longitude;	// of _axis_, with y as the polar axis
+};
+
+static ViewCone viewCone(const PPC &ppc) {
+	ViewCone cone;
+	cone.axis = (ppc.a * (0.5f * ppc.w) + ppc.b * (0.5f * ppc.h) + ppc.c).normalized();
+	// the frame is convex, so its farthest rays are the corners.
+	float minCos = 1.0f;
+	for (int k = 0; k < 4; ++k) {
+		Vector3f corner = ppc.a * float(k & 1 ? ppc.w : 0) + ppc.b * float(k & 2 ? ppc.h : 0) + ppc.c;
+		minCos = std::min(minCos, cone.axis.dot(corner.normalized()));
+	}
+	cone.radius = std::acos(std::max(-1.0f, std::min(1.0f, minCos)));
+	cone.latitude = std::asin(std::max(-1.0f, std::min(1.0f, cone.axis.y)));
+	cone.longitude = std::atan2(cone.axis.x, cone.axis.z);
+	return cone;
+}
+
+void buildOverlapGraph(const std::vector< std::unique_ptr<PPC> > & cameras, OverlapGraph & graph) {
+	const int nImages = int(cameras.size());
+	std::vector<ViewCone> cones(nImages);
+	float maxRadius = 0.0f;
+	for (int i = 0; i < nImages; ++i) {
+		cones[i] = viewCone(*cameras[i]);
+		maxRadius = std::max(maxRadius, cones[i].radius);
+	}
+
+	// cells about as large as the cones, so that a query only visits a few of them.
+	const float cellSize = std::max(maxRadius, PI / 180.0f);
+	const int nRows = std::max(1, int(std::ceil(PI / cellSize)));
+	const int nCols = std::max(1, int(std::ceil(2.0f * PI / cellSize)));
+	auto rowOf = [&](float latitude) { return std::min(nRows - 1, std::max(0, int((latitude + 0.5f * PI) / PI * nRows))); };
+	auto colOf = [&](float longitude) { return ((int(std::floor((longitude + PI) / (2.0f * PI) * nCols)) % nCols) + nCols) % nCols; };
+	std::vector< std::vector<int> > cells(nRows * nCols);
+	for (int i = 0; i < nImages; ++i) {
+		cells[rowOf(cones[i].latitude) * nCols + colOf(cones[i].longitude)].push_back(i);
+	}
+
+	// every camera looks for the later cameras whose cones may intersect its own.
+	std::vector< std::vector<OverlapEdge> > found(nImages);
+#pragma omp parallel for schedule(dynamic)
+	for (int i = 0; i < nImages; ++i) {
+		const ViewCone &cone = cones[i];
+		// the axes of all cones that may intersect this one lie in a cap of radius _reach_.
+		const float reach = cone.radius + maxRadius;
+		int row0 = 0, row1 = nRows - 1, col0 = 0, col1 = nCols - 1;
+		if (reach < PI) {
+			row0 = rowOf(cone.latitude - reach);
+			row1 = rowOf(cone.latitude + reach);
+			float cosLatitude = std::cos(cone.latitude);
+			// unless the cap contains a pole, it spans asin(sin(reach) / cos(latitude)) in longitude.
+			if (cone.latitude - reach > -0.5f * PI && cone.latitude + reach < 0.5f * PI && std::sin(reach) < cosLatitude) {
+				float halfWidth = std::asin(std::sin(reach) / cosLatitude);
+				int width = int(std::ceil(halfWidth / (2.0f * PI) * nCols)) + 1;
+				if (2 * width + 1 < nCols) {
+					int center = colOf(cone.longitude);
+					col0 = center - width;
+					col1 = center + width;
+				}
+			}
+		}
+
+		std::vector<cv::Point2d> polygon;
+		for (int r = row0; r <= row1; ++r) {
+			for (int c = col0; c <= col1; ++c) {
+				for (int j : cells[r * nCols + (c % nCols + nCols) % nCols]) {
+					if (j <= i) continue;
+					float cosAngle = std::max(-1.0f, std::min(1.0f, cone.axis.dot(cones[j].axis)));
+					if (std::acos(cosAngle) > cone.radius + cones[j].radius) continue;
+					OverlapEdge edge;
+					edge.i = i;
+					edge.j = j;
+					edge.area = overlapPolygon(cameras[i].get(), cv::Size(cameras[i]->w, cameras[i]->h),
+						cameras[j].get(), cv::Size(cameras[j]->w, cameras[j]->h), polygon);
+					if (edge.area > 0.0) found[i].push_back(edge);
+				}
+			}
+		}
+		std::sort(found[i].begin(), found[i].end(), [](const OverlapEdge &a, const OverlapEdge &b) { return a.j < b.j; });
+	}
+
+	graph.edges.clear();
+	graph.adjacent.assign(nImages, std::vector<int>());
+	for (int i = 0; i < nImages; ++i) {
+		for (const OverlapEdge &edge : found[i]) {
+			graph.adjacent[edge.i].push_back(int(graph.edges.size()));
+			graph.adjacent[edge.j].push_back(int(graph.edges.size()));
+			graph.edges.push_back(edge);
+		}
+	}
+}
+
+// Accumulates, in a single pass over image _i_, the number of its pixels whose centers fall
+// inside each of the images _partners_ and the sum of their colors.
+static void overlapRow(int i, const std::vector< std::unique_ptr<PPC> > & cameras, const std::vector<cv::Mat> & images,
+	const std::vector<int> & partners, std::vector<long long> & counts, std::vector<cv::Vec3d> & sums)
+{
+	const cv::Mat &im = images[i];
+	assert(im.channels() == 3);
+	assert(im.depth() == CV_32F);
+	const int nPartners = int(partners.size());
+
+	// M[k] maps homogeneous pixel coordinates of image _i_ to image partners[k].
+	Matrix3f Mi = cameras[i]->GetBasis();
+	std::vector<Matrix3f> M(nPartners);
+	for (int k = 0; k < nPartners; ++k)
+		M[k] = cameras[partners[k]]->GetInverseBasis()*Mi;
+
+	counts.assign(nPartners, 0);
+	sums.assign(nPartners, cv::Vec3d(0.0, 0.0, 0.0));
+#pragma omp parallel
+	{
+		std::vector<long long> threadCounts(nPartners, 0);
+		std::vector<cv::Vec3d> threadSums(nPartners, cv::Vec3d(0.0, 0.0, 0.0));
+		// prefix[c] is the sum of the first _c_ colors of the row, so any span costs two lookups.
+		std::vector<cv::Vec3d> prefix(im.cols + 1);
+
+#pragma omp for schedule(static)
+		for (int r = 0; r < im.rows; ++r) {
+			const cv::Vec3f *row = im.ptr<cv::Vec3f>(r);
+			prefix[0] = cv::Vec3d(0.0, 0.0, 0.0);
+			for (int c = 0; c < im.cols; ++c) {
+				prefix[c + 1] = prefix[c] + cv::Vec3d(row[c][0], row[c][1], row[c][2]);
+			}
+
+			for (int k = 0; k < nPartners; ++k) {
+				int c0, c1;
+				if (!insideSpan(M[k], r, im.cols, images[partners[k]].size(), c0, c1))
+					continue;
+				threadCounts[k] += c1 - c0;
+				threadSums[k] += prefix[c1] - prefix[c0];
+			}
+		}
+
+#pragma omp critical
+		{
+			for (int k = 0; k < nPartners; ++k) {
+				counts[k] += threadCounts[k];
+				sums[k] += threadSums[k];
+			}
+		}
+	}
+}
+
+void computeOverlapStats(const std::vector< std::unique_ptr<PPC> > & cameras, const std::vector<cv::Mat> & images,
+	OverlapGraph & graph)
+{
+	const int nImages = int(cameras.size());
+	std::vector<int> partners;
+	std::vector<long long> counts;
+	std::vector<cv::Vec3d> sums;
+	for (int i = 0; i < nImages; ++i) {
+		const std::vector<int> &adjacent = graph.adjacent[i];
+		partners.clear();
+		for (int e : adjacent) {
+			const OverlapEdge &edge = graph.edges[e];
+			partners.push_back(edge.i == i ? edge.j : edge.i);
+		}
+		overlapRow(i, cameras, images, partners, counts, sums);
+
+		for (size_t k = 0; k < adjacent.size(); ++k) {
+			OverlapEdge &edge = graph.edges[adjacent[k]];
+			cv::Vec3d mean = counts[k] > 0 ? sums[k] * (1.0 / counts[k]) : cv::Vec3d(0.0, 0.0, 0.0);
+			cv::Vec3f average = cv::Vec3f(float(mean[0]), float(mean[1]), float(mean[2]));
+			if (edge.i == i) {
+				edge.nIJ = int(counts[k]);
+				edge.averageIJ = average;
+			}
+			else {
+				edge.nJI = int(counts[k]);
+				edge.averageJI = average;
+			}
+		}
+	}
+}
+
+// <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<< Overlap graph <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
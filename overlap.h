@@ -0,0 +1,49 @@
+#pragma once
+#include "geometry.h"
+#include "ppc.h"
+#include <opencv2/core.hpp>
+#include <memory>
+#include <vector>
+// overlap statistics between the images of a panorama.
+
+// Region of image _i_ that also shows in image _j_ (in front of camera _j_), computed
+// analytically: seen from image _i_, the frame of image _j_ is bounded by five lines
+// (its four borders and the plane of camera _j_), so the overlap is the frame of image _i_
+// clipped by them, a convex polygon of at most 9 vertices.
+// _polygon_ receives its vertices in pixel coordinates of image _i_, where pixel (c, r)
+// covers [c, c + 1) x [r, r + 1). Returns its area in pixels of image _i_, which matches
+// OverlapEdge::nIJ up to the pixels cut by the border of the polygon.
+// No pixels are read, so this is cheap enough to decide which pairs to look at in the first place.
+double overlapPolygon(const PPC * iPPC, cv::Size iSize, const PPC * jPPC, cv::Size jSize,
+	std::vector<cv::Point2d> & polygon);
+
+// Two images whose frames overlap, i < j.
+struct OverlapEdge {
+	int i, j;
+	double area;					// of the overlap, in pixels of image _i_ (see overlapPolygon)
+
+	// filled in by computeOverlapStats:
+	int nIJ = 0, nJI = 0;			// pixels of image _i_ whose centers fall inside image _j_, and vice versa
+	cv::Vec3f averageIJ, averageJI;	// average colors of those pixels, in images _i_ and _j_
+};
+
+// The pairs of overlapping images of a panorama, for sets of images too large to look at
+// every pair. Only the edges are stored, so everything done per edge scales with the number
+// of overlaps rather than with the square of the number of images.
+struct OverlapGraph {
+	std::vector<OverlapEdge> edges;				// sorted by (i, j)
+	std::vector< std::vector<int> > adjacent;	// adjacent[i]: indices into _edges_ of the edges of image _i_
+
+	// index of the edge between images _i_ and _j_ (in either order), or -1 if they do not overlap.
+	int edge(int i, int j) const;
+};
+
+// Finds the overlapping pairs among _cameras_ (which share their center) from the cameras alone.
+// Every camera is bounded by a cone around its central ray; the cones are binned by direction
+// in a latitude-longitude grid over the sphere, so each camera is only tested against the
+// cameras in nearby cells. The pairs whose cones intersect are confirmed with overlapPolygon.
+void buildOverlapGraph(const std::vector< std::unique_ptr<PPC> > & cameras, OverlapGraph & graph);
+
+// Fills the pixel counts and average colors of every edge of _graph_, in one pass over each image.
+void computeOverlapStats(const std::vector< std::unique_ptr<PPC> > & cameras, const std::vector<cv::Mat> & images,
+	OverlapGraph & graph);
@@ -1,4 +1,5 @@
 #include "ppc.h"
+#include <algorithm>
 #include <cmath>
 #include <fstream>
 #include <iostream>
@@ -14,6 +15,49 @@ PPC::PPC(int _w, int _h, float hfov)
 {
 	float halfFov = TO_RADIANS(hfov*0.5);
 	c = Vector3f{ -w*0.5f, h*0.5f, -w*0.5f / std::tanf(halfFov) };
+	UpdateDerived();
+}
+
+void PPC::UpdateDerived() {
+	// the camera frame in world coordinates: x = a, y = -b, z = b ^ a.
+	Vector3f xAxis = a.normalized();
+	Vector3f zAxis = (b^a).normalized();
+	orientation.fromRotMatrix(Matrix3f{ xAxis, zAxis ^ xAxis, zAxis });
+
+	Matrix3f R = orientation.toRotMatrix();
+	Matrix3f toLocal = R.transposed();
+	aLocal = toLocal * a;
+	bLocal = toLocal * b;
+	cLocal = toLocal * c;
+	localInverse = Matrix3f{ aLocal, bLocal, cLocal }.inverted();
+
+	// we have cross(a, -b) = -vd, or cross(a, b) = vd, which is -z in the camera frame.
+	focal = -cLocal.z;
+	assert(focal >= 0);
+	Materialize();
+}
+
+void PPC::Materialize() {
+	Matrix3f R = orientation.toRotMatrix();
+	a = R * aLocal;
+	b = R * bLocal;
+	c = R * cLocal;
+	// [a b c] = R [aLocal bLocal cLocal], and R is orthonormal.
+	basisInverse = localInverse * R.transposed();
+	viewDir = -R.col(2);
+}
+
+void PPC::SetDistortion(const LensDistortion & newDistortion) {
+	distortion = newDistortion;
+	if (distortion.isIdeal()) {
+		undistortion.reset();
+		return;
+	}
+	// in the camera frame a is along x and b along -y, so the view direction goes through
+	// pixel (-cLocal.x / |a|, cLocal.y / |b|).
+	float pixelSize = aLocal.x;
+	float cx = -cLocal.x / pixelSize, cy = cLocal.y / -bLocal.y;
+	undistortion = std::make_shared<const UndistortionMap>(distortion, cv::Size(w, h), cx, cy, focal / pixelSize);
 }
 
 float PPC::GetHFOV() const {
@@ -25,8 +69,7 @@ float PPC::GetHFOV() const {
 
 bool PPC::Project(const Point3f &p, Point3f *projP) const {
 	// p = C + (au + bv + c)*w = C + M[uw,vw,w]
-	Matrix3f M{ a, b, c };
-	Vector3f x = M.inverted() * (p - C);
+	Vector3f x = basisInverse * (p - C);
 	if (x[2] <= 0.0) return false;
 
 	*projP = Point3f(x / x[2]);
@@ -53,41 +96,49 @@ void PPC::PositionAndOrient(const Point3f & newC, const Point3f & target, const
 	b = -upDir * b.length();
 	c = f * viewDir - h * 0.5 * b - w * 0.5 * a;
 
-	GetF();
+	UpdateDerived();
 }
 
-float PPC::GetF() const {
-	float f = c * GetVD();
-	assert(f >= 0);
-	return f;
+// Pan, Tilt and Roll turn around the camera's own up, right and view directions,
+// which are fixed axes in the camera frame.
+void PPC::Pan(float degrees) {
+	Rotate(Quaternion::rotater(Vector3f::YBASE, degrees));
 }
 
-// we have cross(a, -b) = -vd, or cross(a, b) = vd.
-Vector3f PPC::GetVD() const {
-	return (a^b).normalized();
+void PPC::Tilt(float degrees) {
+	Rotate(Quaternion::rotater(Vector3f::XBASE, degrees));
 }
 
-void PPC::Pan(float degrees) {
-	Matrix3f rot = Matrix3f::rotate(-b, degrees);
-	a = rot*a;
-	c = rot*c;
+void PPC::Roll(float degrees) {
+	Rotate(Quaternion::rotater(-Vector3f::ZBASE, degrees));
 }
 
-void PPC::Tilt(float degrees) {
-	Matrix3f rot = Matrix3f::rotate(a, degrees);
-	b = rot*b; 
-	c = rot*c;
+void PPC::PanTiltRoll(float pan, float tilt, float roll) {
+	Rotate(Quaternion::rotater(-Vector3f::ZBASE, roll)
+		* Quaternion::rotater(Vector3f::XBASE, tilt)
+		* Quaternion::rotater(Vector3f::YBASE, pan));
 }
 
-void PPC::Roll(float degrees) {
-	Matrix3f rot = Matrix3f::rotate(GetVD(), degrees);
-	a = rot*a;
-	b = rot*b;
-	c = rot*c;
+void PPC::Rotate(const Quaternion & q) {
+	// toRotMatrix(p * q) = toRotMatrix(q) * toRotMatrix(p), so turning by _q_ after the
+	// current orientation is a product on the left.
+	orientation = (q * orientation).normalized();
+	Materialize();
+}
+
+void PPC::RelativePanTiltRoll(const PPC & ref, float & pan, float & tilt, float & roll) const {
+	// in right-handed rotations, PanTiltRoll turns the camera frame by Ry(-pan) * Rx(-tilt) * Rz(roll),
+	// so the rotation from _ref_ to this camera, M = Rref^T * R, is decomposed in that order.
+	Matrix3f M = ref.orientation.toRotMatrix().transposed() * orientation.toRotMatrix();
+	auto m = [&](int r, int c) { return M.columns[c][r]; };
+	const float TO_DEGREES = 180.0f / 3.14159265358979f;
+	tilt = std::asin(std::min(std::max(m(1, 2), -1.0f), 1.0f)) * TO_DEGREES;
+	pan = -std::atan2(m(0, 2), m(2, 2)) * TO_DEGREES;
+	roll = std::atan2(m(1, 0), m(1, 1)) * TO_DEGREES;
 }
 
 Point3f PPC::GetPoint(float uf, float vf, float z) const {
-	return C + (a*uf + b * vf + c) * z / GetF();
+	return C + (a*uf + b * vf + c) * (z / focal);
 }
 
 Point3f PPC::Unproject(const Point3f & pp) const
@@ -95,6 +146,55 @@ Point3f PPC::Unproject(const Point3f & pp) const
 	return C + (a*pp[0] + b*pp[1] + c) / pp[2];
 }
 
+// >>>>>>>>>>>>>>>>>>>>>>>>>>>>>> Batch projection >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
+
+void PPC::ProjectBatch(const float *x, const float *y, const float *z, int n,
+	float *u, float *v, float *invW, std::uint32_t *valid) const
+{
+	// [uw, vw, w] = basisInverse * (p - C), projected in chunks of points moved to the camera center.
+	const int CHUNK = 256;	// a multiple of 32, so every chunk starts at a word of _valid_
+	float dx[CHUNK], dy[CHUNK], dz[CHUNK];
+	const Vector3f wRow = basisInverse.row(2);
+	for (int k0 = 0; k0 < n; k0 += CHUNK) {
+		const int m = std::min(CHUNK, n - k0);
+		for (int k = 0; k < m; ++k) {
+			dx[k] = x[k0 + k] - C.x;
+			dy[k] = y[k0 + k] - C.y;
+			dz[k] = z[k0 + k] - C.z;
+		}
+		basisInverse.projectBatch(dx, dy, dz, m, u + k0, v + k0, valid + k0 / 32);
+		for (int k = 0; k < m; ++k) {
+			invW[k0 + k] = 1.0f / (wRow.x * dx[k] + wRow.y * dy[k] + wRow.z * dz[k]);
+		}
+	}
+}
+
+void PPC::UnprojectBatch(const float *u, const float *v, const float *invW, int n,
+	float *x, float *y, float *z) const
+{
+	// p = C + (a u + b v + c) w
+	int k = 0;
+	for (; k + 4 <= n; k += 4) {
+		__m128 vu = _mm_loadu_ps(u + k), vv = _mm_loadu_ps(v + k);
+		__m128 w = _mm_div_ps(_mm_set1_ps(1.0f), _mm_loadu_ps(invW + k));
+		auto coord = [&](float origin, float p, float q, float r) {
+			__m128 ray = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(p), vu), _mm_mul_ps(_mm_set1_ps(q), vv)), _mm_set1_ps(r));
+			return _mm_add_ps(_mm_set1_ps(origin), _mm_mul_ps(ray, w));
+		};
+		_mm_storeu_ps(x + k, coord(C.x, a.x, b.x, c.x));
+		_mm_storeu_ps(y + k, coord(C.y, a.y, b.y, c.y));
+		_mm_storeu_ps(z + k, coord(C.z, a.z, b.z, c.z));
+	}
+	for (; k < n; ++k) {
+		float w = 1.0f / invW[k];
+		x[k] = C.x + (a.x * u[k] + b.x * v[k] + c.x) * w;
+		y[k] = C.y + (a.y * u[k] + b.y * v[k] + c.y) * w;
+		z[k] = C.z + (a.z * u[k] + b.z * v[k] + c.z) * w;
+	}
+}
+
+// <<<<<<<<<<<<<<<<<<<<<<<<<<<<<< Batch projection <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+
 glm::mat4 PPC::GetProjectionTrans(float nearZ, float farZ) const {
 	float horizonFov = GetHFOV();
 	float aspRatio = float(w) / float(h);
@@ -102,7 +202,6 @@ glm::mat4 PPC::GetProjectionTrans(float nearZ, float farZ) const {
 }
 
 glm::mat4 PPC::GetViewTrans() const {
-	Vector3f viewDir = GetVD();
 	Point3f target = C + viewDir;
 	
 	glm::vec3 from{ C.x, C.y, C.z };
@@ -119,6 +218,7 @@ void PPC::SaveToTextFile(const char *fname) const {
 	ofs << b.x << ' ' << b.y << ' ' << b.z << std::endl;
 	ofs << c.x << ' ' << c.y << ' ' << c.z << std::endl;
 	ofs << C.x << ' ' << C.y << ' ' << C.z << std::endl;
+	ofs << distortion.k1 << ' ' << distortion.k2 << ' ' << distortion.k3 << ' ' << distortion.p1 << ' ' << distortion.p2 << std::endl;
 	//ofs << a << std::endl << b << std::endl << c << std::endl << C << std::endl;
 	ofs.close();
 
@@ -135,5 +235,11 @@ void PPC::LoadFromTextFile(const char *fname) {
 	ifs >> b.x >> b.y  >> b.z;
 	ifs >> c.x >> c.y  >> c.z;
 	ifs >> C.x >> C.y  >> C.z;
+	// files written before the lens model have no distortion line.
+	LensDistortion d;
+	ifs >> d.k1 >> d.k2 >> d.k3 >> d.p1 >> d.p2;
+	if (ifs.fail()) d = LensDistortion();
 	ifs.close();
+	UpdateDerived();
+	SetDistortion(d);
 }
\ No newline at end of file
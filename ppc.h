@@ -1,15 +1,22 @@
 #pragma once
 
 #include "geometry.h"
+#include "lens.h"
+#include "quaternion.h"
 #include <glm/fwd.hpp>
+#include <memory>
 class FrameBuffer;
 
 
 // the PPC class uses right-handed system. x goes right, y goes up, z goes outside the monitor.
+// The orientation is kept as a unit quaternion that turns the camera's own frame (x right,
+// y up, z backwards) into the world; a, b and c are that rotation applied to their values in
+// the camera frame, and are recomputed whenever the camera rotates.
 class PPC {
 public:
 	// Vector a: pixel vector along right direction
 	// Vector b: pixel vector along up direction
+	// After changing a, b or c directly, call UpdateDerived().
 	Vector3f a, b, c;
 	Point3f C;
 	int w, h; // in number of pixels
@@ -32,11 +39,27 @@ public:
 	void Tilt(float theta);
 	// - view direction
 	void Roll(float theta);
+	// same as Pan(pan), Tilt(tilt), Roll(roll), but composes the rotations first
+	// and recomputes a, b and c once.
+	void PanTiltRoll(float pan, float tilt, float roll);
+	// rotates the camera by _q_, given in the camera frame.
+	void Rotate(const Quaternion & q);
+	// The angles, in degrees, for which _ref_.PanTiltRoll(pan, tilt, roll) has the orientation
+	// of this camera; tilt is in [-90, 90].
+	void RelativePanTiltRoll(const PPC & ref, float & pan, float & tilt, float & roll) const;
 	
 	// interpolate the two cameras (ppc0 and ppc1) by _fracf_.
 	// What about using spherical linear interpolation?
 	void SetInterpolated(PPC *ppc0, PPC *ppc1, float fracf);
 	
+	// Sets the distortion of the lens and builds its undistortion map, from the current
+	// principal point and focal length (set those first).
+	void SetDistortion(const LensDistortion & distortion);
+
+	// Recomputes the orientation, the cached inverse basis, view direction and focal length
+	// from a, b and c. The methods above call it themselves.
+	void UpdateDerived();
+
 	// <<<<<<<<<<<<<<<<<<<< Set camera intrinsics and extrinsics <<<<<<<<<<<<<<<<<<
 
 	float GetHFOV() const;
@@ -47,10 +70,20 @@ public:
 	
 
 	// get focus length: dist(C, image-plane)
-	float GetF() const;
+	float GetF() const { return focal; }
 
 	// view direction
-	Vector3f GetVD() const;
+	Vector3f GetVD() const { return viewDir; }
+
+	// [a b c], mapping [u, v, 1] to the ray through pixel (u, v), and its inverse.
+	Matrix3f GetBasis() const { return Matrix3f{ a, b, c }; }
+	const Matrix3f & GetInverseBasis() const { return basisInverse; }
+	const Quaternion & GetOrientation() const { return orientation; }
+
+	const LensDistortion & GetDistortion() const { return distortion; }
+	// where the pixels of the ideal image are in the captured one; null for an ideal pinhole.
+	// Copies of the camera share the map.
+	const std::shared_ptr<const UndistortionMap> & GetUndistortionMap() const { return undistortion; }
 
 
 	// Draw the camera (like Blender does)
@@ -63,6 +96,17 @@ public:
 	// Inverse operation against _Project(p, &pp)_ method.
 	Point3f Unproject(const Point3f & pp) const;
 
+	// Project and Unproject over many points at once, given as separate coordinate arrays,
+	// four points per SSE instruction (see Matrix3f::projectBatch).
+	// ProjectBatch writes [u, v, 1/w] of point _k_ to u[k], v[k] and invW[k], and sets bit k % 32
+	// of valid[k / 32] (see batchValid) if the point is in front of the camera; the outputs are
+	// meaningless where it is not. _valid_ must hold (n + 31) / 32 words.
+	void ProjectBatch(const float *x, const float *y, const float *z, int n,
+		float *u, float *v, float *invW, std::uint32_t *valid) const;
+	// Unprojects the points [u[k], v[k], invW[k]], whose invW[k] must not be 0.
+	void UnprojectBatch(const float *u, const float *v, const float *invW, int n,
+		float *x, float *y, float *z) const;
+
 	
 	//void SaveToTextFile(char *fname);
 	//void LoadFromTextFile(char *fname);
@@ -83,4 +127,20 @@ public:
 	void SaveToTextFile(const char * filename) const;
 	void LoadFromTextFile(const char * filename);
 
+private:
+	// sets a, b, c and the cached state from the orientation.
+	void Materialize();
+
+	Quaternion orientation;
+	// a, b, c in the camera frame, and the inverse of [aLocal bLocal cLocal].
+	Vector3f aLocal, bLocal, cLocal;
+	Matrix3f localInverse;
+
+	// derived from the above.
+	Matrix3f basisInverse;
+	Vector3f viewDir;
+	float focal;
+
+	LensDistortion distortion;
+	std::shared_ptr<const UndistortionMap> undistortion;
 };
\ No newline at end of file
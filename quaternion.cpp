@@ -6,9 +6,6 @@
 Quaternion::Quaternion()
 	:xyz{ Vector3f::XBASE }, w{ 0.0f } {}
 
-inline Quaternion::Quaternion(const Vector3f & v, float w)
-	: xyz{ v }, w{ w } {}
-
 
 // >>>>>>>>>>>>>>>>>>>>>>>>>>>>> HELPERS >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
 static inline constexpr float TO_RADIAN(float degree) {
@@ -33,7 +30,7 @@ Quaternion::operator-(const Quaternion &rhs) const {
 Quaternion
 Quaternion::operator*(const Quaternion &rhs) const {
 	float w_ = w*rhs.w - xyz*rhs.xyz;
-	Vector3f xyz_ = xyz^rhs.xyz + rhs.xyz*w + xyz*rhs.w;
+	Vector3f xyz_ = (xyz^rhs.xyz) + rhs.xyz*w + xyz*rhs.w;
 	return Quaternion{ xyz_, w_ };
 }
 
@@ -59,7 +56,7 @@ Quaternion::operator-=(const Quaternion &rhs) {
 Quaternion &
 Quaternion::operator*=(const Quaternion &rhs) {
 	float w_ = w*rhs.w - xyz*rhs.xyz;
-	Vector3f xyz_ = xyz^rhs.xyz + rhs.xyz*w + xyz*rhs.w;
+	Vector3f xyz_ = (xyz^rhs.xyz) + rhs.xyz*w + xyz*rhs.w;
 	this->xyz = xyz_; this->w = w_;
 	return *this;
 }
@@ -144,25 +141,31 @@ void Quaternion::fromRotMatrix(const Matrix3f &m) {
 	Matrix3f id = m*m.transposed();
 	Matrix3f diff = id - Matrix3f::IDENTITY;
 	if (diff.frobeniusNorm() < 0.001) {
-		// trace(m) = 3-2(y2 + z2 + x2 + z2 + x2 + y2) = 3-4(x^2+y^2+z^2);
-		// xyz*xyz = 0.25*(3-trace)
+		// the inverse of toRotMatrix(). Divide by the largest of |x|, |y|, |z|, |w| so that
+		// rotations by about 180 degrees (w ~ 0) stay accurate.
 		const Vector3f &c0 = m.col(0), &c1 = m.col(1), &c2 = m.col(2);
-		float vnorm = 0.5f*std::sqrt(3 - c0[0] - c1[1] - c2[2]);
-		float zw = 0.25f*(c1[0] - c0[1]);
-		float yw = 0.25f*(c0[2] - c2[0]);
-		float xw = 0.25f*(c2[1] - c1[2]);
-		Vector3f xyz_{ xw, yw, zw };
-		// {xw, yw, zw} = {x, y, z} * w.
-		float w_ = xyz_.length() / vnorm;
-		if (std::isnan(w_)) {
-			this->xyz = xyz_;
-			this->w = 1.0f;
-		} else {
-			xyz_ /= w_;
-			this->xyz = xyz_;
-			this->w = w_;
-			this->normalize();
+		float trace = c0[0] + c1[1] + c2[2];
+		if (trace > 0) {
+			float s = 2.0f * std::sqrt(1 + trace);	// 4w
+			this->xyz = Vector3f{ c2[1] - c1[2], c0[2] - c2[0], c1[0] - c0[1] } / s;
+			this->w = 0.25f * s;
+		}
+		else if (c0[0] > c1[1] && c0[0] > c2[2]) {
+			float s = 2.0f * std::sqrt(1 + c0[0] - c1[1] - c2[2]);	// 4x
+			this->xyz = Vector3f{ 0.25f * s, (c1[0] + c0[1]) / s, (c0[2] + c2[0]) / s };
+			this->w = (c2[1] - c1[2]) / s;
+		}
+		else if (c1[1] > c2[2]) {
+			float s = 2.0f * std::sqrt(1 - c0[0] + c1[1] - c2[2]);	// 4y
+			this->xyz = Vector3f{ (c1[0] + c0[1]) / s, 0.25f * s, (c2[1] + c1[2]) / s };
+			this->w = (c0[2] - c2[0]) / s;
+		}
+		else {
+			float s = 2.0f * std::sqrt(1 - c0[0] - c1[1] + c2[2]);	// 4z
+			this->xyz = Vector3f{ (c0[2] + c2[0]) / s, (c2[1] + c1[2]) / s, 0.25f * s };
+			this->w = (c1[0] - c0[1]) / s;
 		}
+		this->normalize();
 	}
 	else
 		std::cout << "not a unitary matrix\n";
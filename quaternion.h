@@ -5,7 +5,7 @@ class Quaternion
 {
 public:
 	Quaternion();
-	Quaternion(const Vector3f &v, float w);
+	Quaternion(const Vector3f &v, float w) : xyz{ v }, w{ w } {}
 
 	static Quaternion rotater(const Vector3f &axis, float degree);
 
@@ -0,0 +1,60 @@
+#include "resampling.h"
+#include <opencv2/imgproc.hpp>
+#include <cassert>
+
+static const float PI = 3.14159265358979f;
+
+// Keys' cubic convolution kernel with a = -0.5.
+static float cubicKernel(float d) {
+	const float a = -0.5f;
+	d = std::abs(d);
+	if (d < 1.0f) return ((a + 2.0f) * d - (a + 3.0f)) * d * d + 1.0f;
+	if (d < 2.0f) return ((a * d - 5.0f * a) * d + 8.0f * a) * d - 4.0f * a;
+	return 0.0f;
+}
+
+static float sinc(float d) {
+	return d == 0.0f ? 1.0f : std::sin(PI * d) / (PI * d);
+}
+
+static float lanczos3Kernel(float d) {
+	return std::abs(d) < 3.0f ? sinc(d) * sinc(d / 3.0f) : 0.0f;
+}
+
+Resampler::Resampler(ResampleFilter filter) : kind(filter) {
+	float(*kernel)(float) = nullptr;
+	switch (filter) {
+	case RESAMPLE_BILINEAR: nTaps = 2; kernel = [](float d) { return std::max(1.0f - std::abs(d), 0.0f); }; break;
+	case RESAMPLE_BICUBIC:  nTaps = 4; kernel = cubicKernel; break;
+	case RESAMPLE_LANCZOS3: nTaps = 6; kernel = lanczos3Kernel; break;
+	default:                nTaps = 1; return;
+	}
+
+	// tap _k_ sits at k - (nTaps / 2 - 1) pixels from the pixel center left of the sample position.
+	weights.resize((RESAMPLE_PHASES + 1) * nTaps);
+	for (int p = 0; p <= RESAMPLE_PHASES; ++p) {
+		float offset = float(p) / RESAMPLE_PHASES;
+		float *w = &weights[p * nTaps];
+		float sum = 0.0f;
+		for (int k = 0; k < nTaps; ++k) {
+			w[k] = kernel(float(k - (nTaps / 2 - 1)) - offset);
+			sum += w[k];
+		}
+		// normalize so that flat regions keep their color exactly.
+		for (int k = 0; k < nTaps; ++k) {
+			w[k] /= sum;
+		}
+	}
+}
+
+void buildMipPyramid(const cv::Mat & image, int nLevels, MipPyramid & pyramid) {
+	assert(image.type() == CV_32FC3);
+	pyramid.levels.assign(1, image);
+	while (int(pyramid.levels.size()) < nLevels) {
+		const cv::Mat &prev = pyramid.levels.back();
+		if (prev.cols < 4 || prev.rows < 4) break;
+		cv::Mat next;
+		cv::resize(prev, next, cv::Size((prev.cols + 1) / 2, (prev.rows + 1) / 2), 0.0, 0.0, cv::INTER_AREA);
+		pyramid.levels.push_back(next);
+	}
+}
@@ -0,0 +1,122 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <emmintrin.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+// resampling filters that read source images at non-integer positions.
+
+enum ResampleFilter {
+	RESAMPLE_NEAREST,	// the pixel the position falls in
+	RESAMPLE_BILINEAR,	// 2x2 taps
+	RESAMPLE_BICUBIC,	// 4x4 taps, Keys' cubic convolution with a = -0.5
+	RESAMPLE_LANCZOS3	// 6x6 taps, sinc windowed by a 3 lobe sinc
+};
+
+// sub-pixel offsets are quantized to 1/RESAMPLE_PHASES of a pixel to index the weight tables.
+constexpr int RESAMPLE_PHASES = 64;
+
+// Successively halved copies of a CV_32FC3 image, for reading it where one destination pixel
+// covers several source pixels. levels[0] is the image itself (not a copy).
+struct MipPyramid {
+	std::vector<cv::Mat> levels;
+};
+
+// Builds up to _nLevels_ levels of _image_, each one a box-filtered half of the previous one.
+// Stops early once a level would be smaller than 2 pixels.
+void buildMipPyramid(const cv::Mat & image, int nLevels, MipPyramid & pyramid);
+
+// Samples CV_32FC3 images with one of the filters above. The filter weights for every
+// sub-pixel phase are tabulated once, so a sample costs taps*taps multiply-adds of whole
+// pixels (all three channels at once in an SSE register) and no kernel evaluations.
+// The filters are separable: each row of taps is reduced horizontally first, then the
+// row sums are combined vertically.
+class Resampler {
+public:
+	explicit Resampler(ResampleFilter filter = RESAMPLE_NEAREST);
+
+	ResampleFilter filter() const { return kind; }
+	// number of taps along each axis.
+	int taps() const { return nTaps; }
+
+	// Color of _image_ at (x, y), where pixel (c, r) covers [c, c + 1) x [r, r + 1) as in the
+	// rest of the compositor. Taps that fall outside the image repeat its border pixels.
+	cv::Vec3f sample(const cv::Mat & image, float x, float y) const;
+
+	// Same as above, for a destination pixel whose footprint in the image is _footprint_
+	// pixels wide. Larger footprints are read from the mip levels whose pixels are about as
+	// large (blending the two nearest levels), so that minified images do not alias.
+	cv::Vec3f sample(const MipPyramid & pyramid, float x, float y, float footprint) const;
+
+private:
+	template <int TAPS> cv::Vec3f sampleSeparable(const cv::Mat & image, float x, float y) const;
+
+	ResampleFilter kind;
+	int nTaps;
+	// RESAMPLE_PHASES + 1 rows of nTaps weights; row p holds the weights for a sample that is
+	// p / RESAMPLE_PHASES pixels past the pixel center before it. Rows sum to 1.
+	std::vector<float> weights;
+};
+
+// loads the three channels of _p_ into the low lanes of a register, without reading past the pixel.
+inline __m128 loadPixel(const cv::Vec3f *p) {
+	__m128 lo = _mm_castpd_ps(_mm_load_sd(reinterpret_cast<const double *>(p->val)));
+	__m128 hi = _mm_load_ss(p->val + 2);
+	return _mm_movelh_ps(lo, hi);
+}
+
+template <int TAPS>
+inline cv::Vec3f Resampler::sampleSeparable(const cv::Mat & image, float x, float y) const {
+	// position relative to pixel centers.
+	const float sx = x - 0.5f, sy = y - 0.5f;
+	const float fx = std::floor(sx), fy = std::floor(sy);
+	const float *wx = &weights[int((sx - fx) * RESAMPLE_PHASES + 0.5f) * TAPS];
+	const float *wy = &weights[int((sy - fy) * RESAMPLE_PHASES + 0.5f) * TAPS];
+	const int x0 = int(fx) - (TAPS / 2 - 1), y0 = int(fy) - (TAPS / 2 - 1);
+
+	int cols[TAPS];
+	for (int k = 0; k < TAPS; ++k) {
+		cols[k] = std::min(std::max(x0 + k, 0), image.cols - 1);
+	}
+
+	__m128 sum = _mm_setzero_ps();
+	for (int j = 0; j < TAPS; ++j) {
+		const cv::Vec3f *row = image.ptr<cv::Vec3f>(std::min(std::max(y0 + j, 0), image.rows - 1));
+		__m128 rowSum = _mm_setzero_ps();
+		for (int k = 0; k < TAPS; ++k) {
+			rowSum = _mm_add_ps(rowSum, _mm_mul_ps(loadPixel(row + cols[k]), _mm_set1_ps(wx[k])));
+		}
+		sum = _mm_add_ps(sum, _mm_mul_ps(rowSum, _mm_set1_ps(wy[j])));
+	}
+	float out[4];
+	_mm_storeu_ps(out, sum);
+	return cv::Vec3f(out[0], out[1], out[2]);
+}
+
+inline cv::Vec3f Resampler::sample(const cv::Mat & image, float x, float y) const {
+	switch (kind) {
+	case RESAMPLE_BILINEAR: return sampleSeparable<2>(image, x, y);
+	case RESAMPLE_BICUBIC:  return sampleSeparable<4>(image, x, y);
+	case RESAMPLE_LANCZOS3: return sampleSeparable<6>(image, x, y);
+	default:                return image.ptr<cv::Vec3f>(int(y))[int(x)];
+	}
+}
+
+inline cv::Vec3f Resampler::sample(const MipPyramid & pyramid, float x, float y, float footprint) const {
+	const int nLevels = int(pyramid.levels.size());
+	const cv::Mat &base = pyramid.levels[0];
+	if (footprint <= 1.0f || nLevels == 1)
+		return sample(base, x, y);
+
+	auto sampleLevel = [&](int l) {
+		const cv::Mat &level = pyramid.levels[l];
+		return sample(level, x * level.cols / base.cols, y * level.rows / base.rows);
+	};
+	float lod = std::min(std::log2(footprint), float(nLevels - 1));
+	int l = int(lod);
+	float t = lod - l;
+	cv::Vec3f color = sampleLevel(l);
+	if (t > 0.0f)
+		color = color * (1.0f - t) + sampleLevel(l + 1) * t;
+	return color;
+}
@@ -0,0 +1,174 @@
+#include "tiledcanvas.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> Scratch file >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
+
+static void scratchFileError(const std::string &what, const std::string &path) {
+	std::cerr << "tiled canvas: cannot " << what << " scratch file '" << path << "'" << std::endl;
+	std::exit(1);
+}
+
+#ifdef _WIN32
+
+struct TiledCanvas::ScratchFile {
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+
+	ScratchFile(const std::string &path, std::uint64_t bytes) {
+		file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+			FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+		if (file == INVALID_HANDLE_VALUE) scratchFileError("create", path);
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, DWORD(bytes >> 32), DWORD(bytes), nullptr);
+		if (mapping == nullptr) scratchFileError("map", path);
+	}
+	~ScratchFile() {
+		CloseHandle(mapping);
+		CloseHandle(file);
+	}
+	static size_t granularity() {
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		return info.dwAllocationGranularity;
+	}
+	char * map(std::uint64_t offset, size_t bytes) {
+		return static_cast<char *>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, DWORD(offset >> 32), DWORD(offset), bytes));
+	}
+	void unmap(char *view, size_t) {
+		UnmapViewOfFile(view);
+	}
+};
+
+#else
+
+struct TiledCanvas::ScratchFile {
+	int fd = -1;
+
+	ScratchFile(const std::string &path, std::uint64_t bytes) {
+		fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+		if (fd < 0) scratchFileError("create", path);
+		// the file stays alive through _fd_ and disappears with it.
+		unlink(path.c_str());
+		if (ftruncate(fd, off_t(bytes)) != 0) scratchFileError("resize", path);
+	}
+	~ScratchFile() {
+		close(fd);
+	}
+	static size_t granularity() {
+		return size_t(sysconf(_SC_PAGESIZE));
+	}
+	char * map(std::uint64_t offset, size_t bytes) {
+		void *view = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, off_t(offset));
+		return view == MAP_FAILED ? nullptr : static_cast<char *>(view);
+	}
+	void unmap(char *view, size_t bytes) {
+		munmap(view, bytes);
+	}
+};
+
+#endif
+
+// <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<< Scratch file <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+
+// every tile occupies a full COMPOSITOR_TILE_SIZE square in the file, even at the borders,
+// so that it starts at an offset the OS can map.
+static const size_t TILE_ROW_BYTES = COMPOSITOR_TILE_SIZE * sizeof(cv::Vec3f);
+
+TiledCanvas::TiledCanvas(cv::Size size, const std::string & scratchPath, int maxResidentTiles)
+	: canvasSize(size), tileRects(canvasTiles(size)), maxResident(maxResidentTiles), resident(tileRects.size())
+{
+	assert(maxResidentTiles > 0);
+	size_t granularity = ScratchFile::granularity();
+	size_t tileBytes = TILE_ROW_BYTES * COMPOSITOR_TILE_SIZE;
+	tileStride = (tileBytes + granularity - 1) / granularity * granularity;
+	file.reset(new ScratchFile(scratchPath, std::uint64_t(tileStride) * tileRects.size()));
+}
+
+TiledCanvas::~TiledCanvas() {
+	for (ResidentTile &tile : resident) {
+		if (tile.view) file->unmap(tile.view, tileStride);
+	}
+}
+
+// Unmaps the least recently used tile that is not locked, if any.
+void TiledCanvas::evictOne() {
+	if (lru.empty()) return;
+	int t = lru.back();
+	lru.pop_back();
+	file->unmap(resident[t].view, tileStride);
+	resident[t].view = nullptr;
+	nResident--;
+}
+
+cv::Mat TiledCanvas::lockTile(int t) {
+	std::lock_guard<std::mutex> lock(mutex);
+	ResidentTile &tile = resident[t];
+	if (tile.view) {
+		if (tile.pins == 0) lru.erase(tile.lruPos);
+	}
+	else {
+		while (nResident >= maxResident && !lru.empty())
+			evictOne();
+		tile.view = file->map(std::uint64_t(tileStride) * t, tileStride);
+		if (tile.view == nullptr) {
+			std::cerr << "tiled canvas: cannot map tile " << t << " of the scratch file" << std::endl;
+			std::exit(1);
+		}
+		nResident++;
+	}
+	tile.pins++;
+	const cv::Rect &rect = tileRects[t];
+	return cv::Mat(rect.height, rect.width, CV_32FC3, tile.view, TILE_ROW_BYTES);
+}
+
+void TiledCanvas::unlockTile(int t) {
+	std::lock_guard<std::mutex> lock(mutex);
+	ResidentTile &tile = resident[t];
+	assert(tile.pins > 0);
+	if (--tile.pins == 0) {
+		lru.push_front(t);
+		tile.lruPos = lru.begin();
+	}
+}
+
+bool TiledCanvas::writePPM(const std::string & filename) {
+	std::ofstream ofs(filename, std::ios::binary);
+	if (!ofs) return false;
+	ofs << "P6\n" << canvasSize.width << " " << canvasSize.height << "\n255\n";
+
+	auto toByte = [](float c) {
+		return static_cast<unsigned char>(std::min(std::max(c, 0.0f), 1.0f) * 255.0f + 0.5f);
+	};
+	// the tiles of canvasTiles() are in row-major order, so a strip is complete at the last tile of a row.
+	std::vector<unsigned char> strip(size_t(canvasSize.width) * COMPOSITOR_TILE_SIZE * 3);
+	for (int t = 0; t < int(tileRects.size()); ++t) {
+		const cv::Rect &rect = tileRects[t];
+		cv::Mat pixels = lockTile(t);
+		for (int r = 0; r < rect.height; ++r) {
+			const cv::Vec3f *src = pixels.ptr<cv::Vec3f>(r);
+			unsigned char *dst = &strip[(size_t(r) * canvasSize.width + rect.x) * 3];
+			for (int c = 0; c < rect.width; ++c, dst += 3) {
+				// PPM stores RGB, the canvas BGR.
+				dst[0] = toByte(src[c][2]);
+				dst[1] = toByte(src[c][1]);
+				dst[2] = toByte(src[c][0]);
+			}
+		}
+		unlockTile(t);
+		if (t + 1 == int(tileRects.size()) || tileRects[t + 1].y != rect.y)
+			ofs.write(reinterpret_cast<const char *>(strip.data()), std::streamsize(size_t(canvasSize.width) * rect.height * 3));
+	}
+	return bool(ofs);
+}
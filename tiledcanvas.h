@@ -0,0 +1,60 @@
+#pragma once
+#include "compositor.h"
+#include <opencv2/core.hpp>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+// out-of-core canvas for outputs that do not fit in memory.
+
+// A CV_32FC3 canvas split into the tiles of canvasTiles(), stored in a memory-mapped
+// scratch file instead of RAM. At most _maxResidentTiles_ tiles are mapped at a time;
+// when another tile is needed, the least recently used tile that nobody holds is unmapped
+// and the OS writes it back to the file. The scratch file is deleted when the canvas is destroyed.
+//
+// Tiles are accessed through lockTile/unlockTile, which may be called from several threads.
+// A locked tile stays mapped until it is unlocked, so the number of tiles locked at the same
+// time should stay below _maxResidentTiles_ (e.g. one per thread); otherwise the canvas maps
+// more tiles than requested rather than waiting.
+class TiledCanvas {
+public:
+	TiledCanvas(cv::Size size, const std::string & scratchPath, int maxResidentTiles = 256);
+	~TiledCanvas();
+	TiledCanvas(const TiledCanvas &) = delete;
+	TiledCanvas & operator=(const TiledCanvas &) = delete;
+
+	cv::Size size() const { return canvasSize; }
+	const std::vector<cv::Rect> & tiles() const { return tileRects; }
+
+	// Maps tile _t_ if needed and returns its pixels, tiles()[t].size() in size.
+	// The returned header is valid until the matching unlockTile(t).
+	cv::Mat lockTile(int t);
+	void unlockTile(int t);
+
+	// Writes the canvas to _filename_ as an 8-bit binary PPM, one row of tiles at a time, so that
+	// only a strip COMPOSITOR_TILE_SIZE pixels high is ever held in memory. Colors are clamped
+	// to [0, 1]. Returns false if the file cannot be written.
+	bool writePPM(const std::string & filename);
+
+private:
+	struct ScratchFile;
+	struct ResidentTile {
+		char * view = nullptr;
+		int pins = 0;
+		std::list<int>::iterator lruPos;	// valid while mapped and not pinned
+	};
+
+	void evictOne();
+
+	cv::Size canvasSize;
+	std::vector<cv::Rect> tileRects;
+	size_t tileStride;				// bytes between tiles in the file
+	int maxResident;
+	int nResident = 0;
+
+	std::unique_ptr<ScratchFile> file;
+	std::vector<ResidentTile> resident;
+	std::list<int> lru;				// unpinned mapped tiles, most recently used first
+	std::mutex mutex;
+};